@@ -0,0 +1,347 @@
+/*
+  bench.c : throughput of each conversion stage
+
+  Parses a synthetic multi-megabyte HEX file through the character
+  callback (from a FILE and from memory) and through the buffer entry
+  point.  Then, for HEX images from 1 KiB to 64 KiB, times the stages
+  of a conversion separately over a matrix of sampling rates, sample
+  widths and channel counts:
+    parse      HEX text to image (readihex() without encodeihex())
+    encode     image to mon byte stream
+    count      the counting pass that sizes the output
+    synthesis  rendering the wav data, written to /dev/null
+    write      writing that many bytes to a file in OUTPUT_CHUNK pieces
+  Every stage is repeated for at least BENCH_TIME seconds.  The results
+  go to stdout as CSV, one row per stage and parameter set; columns that
+  do not apply to a stage are left empty.  hex_bytes is always the
+  payload size of the image, and bytes what the stage processed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "intel_hex.h"
+#include "ihex2monl.h"
+
+#define BENCH_SIZE (8 * 1024 * 1024)	/* payload bytes for the parser */
+#define BENCH_RECORD 32			/* payload bytes per record */
+#define BENCH_TIME 0.2			/* seconds of repetition per stage */
+#define BENCH_WRITE (64 * 1024 * 1024)	/* most bytes timed in the write stage */
+
+int hexsizes[] = { 1024, 4096, 16384, 65536 };
+int rates[] = { 11025, 44100, 96000 };
+int bits[] = { 8, 16 };
+int channels[] = { 1, 2 };
+
+#define NELEM(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+struct memory {
+    const char *text;
+    size_t length;
+    size_t position;
+};
+
+/* everything a stage needs, so that one runner repeats them all */
+struct bench {
+    struct tape *t;
+    char *text;
+    size_t length;
+    FILE *null;
+    int fd;
+    char *chunk;
+    long long nbyte;
+};
+
+char *synthesize(size_t, size_t *);
+long parse(struct intel_hex_parser *);
+char file_char(void *);
+char memory_char(void *);
+void parsers(size_t);
+void stages(int, struct output *);
+void stage_read(struct bench *);
+void stage_encode(struct bench *);
+void stage_count(struct bench *);
+void stage_synthesis(struct bench *);
+void stage_write(struct bench *);
+double measure(void (*)(struct bench *), struct bench *);
+void report(char *, size_t, struct tape *, long long, double);
+
+int main(int argc, char *argv[])
+{
+    int i;
+    struct output out;	/* and its writer thread, for all the runs */
+
+    /* readihex() reports every image on stderr; errors go to stdout */
+    if (freopen("/dev/null", "w", stderr) == NULL) {
+	printf("cannot open /dev/null\n");
+	exit(1);
+    }
+
+    printf("stage,hex_bytes,rate,bits,channels,bytes,seconds,mb_per_s\n");
+    parsers(argc > 1 ? atol(argv[1]) : BENCH_SIZE);
+    memset(&out, 0, sizeof(out));
+    for (i = 0; i < NELEM(hexsizes); i++) {
+	stages(hexsizes[i], &out);
+    }
+    return 0;
+}
+
+
+/* the parser alone, through each of its entry points */
+void parsers(size_t size)
+{
+    char *text;
+    size_t length;
+    double start;
+    FILE *fp;
+    struct memory m;
+    struct intel_hex_parser p;
+
+    text = synthesize(size, &length);
+
+    fp = tmpfile();
+    if (fp == NULL || fwrite(text, 1, length, fp) != length) {
+	printf("cannot write temporary file\n");
+	exit(1);
+    }
+    rewind(fp);
+    intel_hex_parser_init(&p, &file_char, fp);
+    start = now();
+    parse(&p);
+    report("parse_getc", size, NULL, length, now() - start);
+    fclose(fp);
+
+    m.text = text;
+    m.length = length;
+    m.position = 0;
+    intel_hex_parser_init(&p, &memory_char, &m);
+    start = now();
+    parse(&p);
+    report("parse_callback", size, NULL, length, now() - start);
+
+    intel_hex_parser_init_buffer(&p, text, length);
+    start = now();
+    parse(&p);
+    report("parse_buffer", size, NULL, length, now() - start);
+
+    free(text);
+}
+
+
+/* every stage of converting an image of size payload bytes */
+void stages(int size, struct output *out)
+{
+    int r, q, c;
+    double read, encode, count;
+    struct tape t;
+    struct ihex ihex;
+    struct wave_cache *caches = NULL;
+    struct bench b;
+    FILE *tmp;
+
+    memset(&ihex, 0, sizeof(ihex));
+    memset(&t, 0, sizeof(t));
+    t.baud_rate = 600;
+    t.carrier_low = 1200;
+    t.stop_bit = 3;
+    t.intelhex = 1;
+    t.format = FORMAT_DEFAULT;
+    t.output = "/dev/null";
+    t.ihex = &ihex;
+    t.out = out;
+    t.caches = &caches;
+
+    memset(&b, 0, sizeof(b));
+    b.t = &t;
+    b.text = synthesize(size, &b.length);
+    b.null = fopen("/dev/null", "wb");
+    b.chunk = calloc(1, OUTPUT_CHUNK);
+    if (b.null == NULL || b.chunk == NULL) {
+	printf("cannot open /dev/null\n");
+	exit(1);
+    }
+
+    read = measure(stage_read, &b);
+    encode = measure(stage_encode, &b);
+    report("parse", size, NULL, b.length, read - encode);
+    report("encode", size, NULL, ihex.monsize, encode);
+
+    for (r = 0; r < NELEM(rates); r++) {
+	for (q = 0; q < NELEM(bits); q++) {
+	    for (c = 0; c < NELEM(channels); c++) {
+		t.sampling_rate = rates[r];
+		t.quantization_bit = bits[q];
+		t.nchannel = channels[c];
+		format_compile(&t);
+
+		count = measure(stage_count, &b);
+		report("count", size, &t, t.size, count);
+		report("synthesis", size, &t, t.size,
+		       measure(stage_synthesis, &b));
+
+		b.nbyte = t.size < BENCH_WRITE ? t.size : BENCH_WRITE;
+		tmp = tmpfile();
+		if (tmp == NULL) {
+		    printf("cannot open temporary file\n");
+		    exit(1);
+		}
+		b.fd = fileno(tmp);
+		report("write", size, &t, b.nbyte, measure(stage_write, &b));
+		fclose(tmp);
+		free(t.program);
+	    }
+	}
+    }
+
+    fclose(b.null);
+    free(b.chunk);
+    free(b.text);
+}
+
+
+void stage_read(struct bench *b)
+{
+    readihex(b->t->ihex, b->text, b->length);
+}
+
+
+void stage_encode(struct bench *b)
+{
+    encodeihex(b->t->ihex);
+}
+
+
+void stage_count(struct bench *b)
+{
+    b->t->size = generate(b->t, NULL) + wav_head_size(b->t);
+}
+
+
+void stage_synthesis(struct bench *b)
+{
+    if (generate(b->t, b->null) + wav_head_size(b->t) != b->t->size) {
+	printf("internal error: size mismatch\n");
+	exit(1);
+    }
+    output_flush(b->t, b->null);
+}
+
+
+void stage_write(struct bench *b)
+{
+    long long done;
+    ssize_t n;
+
+    if (lseek(b->fd, 0, SEEK_SET) != 0 || ftruncate(b->fd, 0) != 0) {
+	printf("cannot rewind temporary file\n");
+	exit(1);
+    }
+    for (done = 0; done < b->nbyte; done += n) {
+	n = write(b->fd, b->chunk, b->nbyte - done < OUTPUT_CHUNK
+		  ? b->nbyte - done : OUTPUT_CHUNK);
+	if (n <= 0) {
+	    printf("cannot write temporary file\n");
+	    exit(1);
+	}
+    }
+}
+
+
+/* seconds per run of stage, repeated until BENCH_TIME has passed */
+double measure(void (*stage)(struct bench *), struct bench *b)
+{
+    long n = 0;
+    double start = now(), elapsed;
+
+    do {
+	stage(b);
+	n++;
+	elapsed = now() - start;
+    } while (elapsed < BENCH_TIME);
+    return elapsed / n;
+}
+
+
+/* DATA records covering size bytes, with ELA records every 64K */
+char *synthesize(size_t size, size_t *length)
+{
+    size_t i, n, address;
+    int sum;
+    char *text, *s;
+    unsigned char data;
+
+    text = malloc((size / BENCH_RECORD + 1) * (12 + 2 * BENCH_RECORD) * 2 + 64);
+    if (text == NULL) {
+	printf("cannot allocate memory\n");
+	exit(1);
+    }
+    s = text;
+    data = 0;
+    for (address = 0; address < size; address += n) {
+	if (address % 0x10000 == 0) {
+	    sum = 2 + 4 + (address >> 24) + (address >> 16 & 0xff);
+	    s += sprintf(s, ":02000004%04X%02X\r\n",
+			 (unsigned)(address >> 16), (unsigned)(-sum & 0xff));
+	}
+	n = size - address < BENCH_RECORD ? size - address : BENCH_RECORD;
+	sum = n + (address >> 8 & 0xff) + (address & 0xff);
+	s += sprintf(s, ":%02X%04X00", (unsigned)n, (unsigned)(address & 0xffff));
+	for (i = 0; i < n; i++) {
+	    data = data * 13 + 7;
+	    sum += data;
+	    s += sprintf(s, "%02X", data);
+	}
+	s += sprintf(s, "%02X\r\n", (unsigned)(-sum & 0xff));
+    }
+    s += sprintf(s, ":00000001FF\r\n");
+    *length = s - text;
+    return text;
+}
+
+
+long parse(struct intel_hex_parser *p)
+{
+    long n = 0;
+    enum intel_hex_slurp_error err;
+    struct intel_hex_record r;
+
+    do {
+	err = intel_hex_parse_record(p, &r);
+	if (err != SLURP_ERROR_NONE) {
+	    printf("Got error 0x%02X, aborting due to invalid record!\n", err);
+	    exit(1);
+	}
+	n++;
+    } while (r.record_type != EOF_RECORD);
+    return n;
+}
+
+
+char file_char(void *fp)
+{
+    return getc((FILE *)fp);
+}
+
+
+char memory_char(void *user)
+{
+    struct memory *m = user;
+
+    return m->position < m->length ? m->text[m->position++] : (char)-1;
+}
+
+
+
+/* one CSV row; t is NULL for the stages that do not depend on it */
+void report(char *stage, size_t hexsize, struct tape *t, long long nbyte,
+	    double seconds)
+{
+    printf("%s,%lu,", stage, (unsigned long)hexsize);
+    if (t != NULL)
+	printf("%d,%d,%d,", t->sampling_rate, t->quantization_bit, t->nchannel);
+    else
+	printf(",,,");
+    printf("%lld,%.6f,%.1f\n", nbyte, seconds,
+	   seconds > 0 ? nbyte / seconds / 1e6 : 0.0);
+}
@@ -0,0 +1,384 @@
+/*
+  cache.c : outputs kept under a hash of the image and the parameters,
+  with --cache
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#include "ihex2monl.h"
+
+#define CACHE_VERSION 1	/* part of every key; bump when outputs change */
+
+/* a file of the cache directory, for eviction */
+struct entry {
+    char name[40];
+    long long size;
+    double mtime;	/* last used */
+};
+
+/* lifetime counters, kept in the stats file of the directory */
+struct counters {
+    long hit;
+    long miss;
+    long evict;
+};
+
+static void cache_key(struct tape *, char *);
+static void cache_hash(unsigned long long *, const void *, size_t);
+static void cache_path(struct tape *, char *);
+static int cache_copy(int, int);
+static int cache_lock(struct tape *, struct counters *);
+static void cache_unlock(int, struct counters *);
+static struct entry *cache_scan(struct tape *, int *, long long *);
+static int cache_compare(const void *, const void *);
+
+
+/*
+ * Makes the output from the cache when an entry for the job exists, and
+ * returns 1.  The entry is cloned to the output where the file system
+ * can, or copied, so a hit costs no synthesis.  The output is never a
+ * link to the entry, which later runs would write through.  An entry
+ * that goes away or cannot be copied is a miss.
+ */
+int cache_fetch(struct tape *t)
+{
+    int from, to, lock;
+    char path[PATH_MAX];
+    struct stat st;
+    struct counters c;
+
+    t->cachehit = -1;
+    if (t->dryrun || strcmp(t->output, "-") == 0
+	|| (lstat(t->output, &st) == 0 && !S_ISREG(st.st_mode))) {
+	return 0;
+    }
+    if (mkdir(t->cachedir, 0777) != 0 && errno != EEXIST) {
+	printf("cannot create %s\n", t->cachedir);
+	exit(1);
+    }
+
+    /* once open, the entry can be evicted under us and still be read */
+    cache_key(t, t->cachekey);
+    cache_path(t, path);
+    t->cachehit = 0;
+    from = open(path, O_RDONLY);
+    if (from >= 0 && fstat(from, &st) == 0 && S_ISREG(st.st_mode)) {
+	to = open(t->output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	t->cachehit = to >= 0 && cache_copy(from, to) == 0;
+	if (to >= 0 && close(to) != 0)
+	    t->cachehit = 0;
+	/* only an output this call truncated is ours to remove */
+	if (to >= 0 && !t->cachehit)
+	    unlink(t->output);
+    }
+    if (from >= 0)
+	close(from);
+
+    lock = cache_lock(t, &c);
+    if (t->cachehit)
+	c.hit++;
+    else
+	c.miss++;
+    cache_unlock(lock, &c);
+    if (!t->cachehit) {
+	return 0;
+    }
+
+    /* recently used entries are evicted last */
+    utimensat(AT_FDCWD, path, NULL, 0);
+    t->size = st.st_size;
+    return 1;
+}
+
+
+/*
+ * Stores the output of a missed job.  It is copied, or cloned where the
+ * file system can, to a temporary file that is renamed to the entry, so
+ * a half-written entry is never seen.  Then old entries are evicted
+ * until the directory is within its size.  An output larger than the
+ * whole cache is not stored at all, as it would be evicted at once.
+ */
+void cache_store(struct tape *t)
+{
+    int i, n, from, to, lock;
+    long long total;
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct entry *e;
+    struct counters c;
+    struct stat st;
+
+    if (t->cachehit != 0) {
+	return;
+    }
+    if (stat(t->output, &st) != 0 || st.st_size > t->cachesize) {
+	return;
+    }
+    snprintf(tmp, sizeof(tmp), "%s/.tmpXXXXXX", t->cachedir);
+    to = mkstemp(tmp);
+    from = open(t->output, O_RDONLY);
+    if (to < 0 || from < 0 || cache_copy(from, to) != 0
+	|| fchmod(to, 0444) != 0) {
+	fprintf(stderr, "cannot store %s in %s\n", t->output, t->cachedir);
+	if (to >= 0) {
+	    close(to);
+	    unlink(tmp);
+	}
+	if (from >= 0)
+	    close(from);
+	return;
+    }
+    close(from);
+    close(to);
+    cache_path(t, path);
+
+    lock = cache_lock(t, &c);
+    if (rename(tmp, path) != 0) {
+	unlink(tmp);
+    }
+    e = cache_scan(t, &n, &total);
+    qsort(e, n, sizeof(struct entry), cache_compare);
+    for (i = 0; i < n && total > t->cachesize; i++) {
+	snprintf(path, sizeof(path), "%s/%s", t->cachedir, e[i].name);
+	if (unlink(path) == 0) {
+	    total -= e[i].size;
+	    c.evict++;
+	}
+    }
+    free(e);
+    cache_unlock(lock, &c);
+}
+
+
+/* hits and misses of this run and of the cache's lifetime, on stderr */
+void cache_report(struct tape *t, int hit, int miss)
+{
+    int n, lock;
+    long long total;
+    struct entry *e;
+    struct counters c;
+
+    if (mkdir(t->cachedir, 0777) != 0 && errno != EEXIST) {
+	return;
+    }
+    lock = cache_lock(t, &c);
+    e = cache_scan(t, &n, &total);
+    cache_unlock(lock, &c);
+    free(e);
+    fprintf(stderr, "cache %s: %d hits, %d misses; %ld hits, %ld misses, "
+	    "%ld evictions in all; %d files, %lld of %lld bytes\n",
+	    t->cachedir, hit, miss, c.hit, c.miss, c.evict, n, total, t->cachesize);
+}
+
+
+/*
+ * The key covers the image and every parameter that changes the output,
+ * written out in a fixed form: "b2" and "b2.0" are the same format.
+ * A cmt file only depends on how many bytes the 'd' sections take.
+ */
+static void cache_key(struct tape *t, char *key)
+{
+    int i, n;
+    char buf[128];
+    unsigned long long h[2];
+    struct section *s;
+    struct extent *e;
+
+    /* two lanes of 64-bit FNV-1a from different offset bases */
+    h[0] = 0xcbf29ce484222325ULL;
+    h[1] = 0x6c62272e07bb0142ULL;
+
+    if (t->cmtfile) {
+	n = snprintf(buf, sizeof(buf), "ihex2monl %d cmt i%d %ld",
+		     CACHE_VERSION, t->intelhex, format_data(t, t->intelhex
+			? (long)t->ihex->monsize : (long)t->in.size));
+    }else{
+	n = snprintf(buf, sizeof(buf),
+		     "ihex2monl %d wav i%d r%d q%d c%d b%d w%d s%d D%d",
+		     CACHE_VERSION, t->intelhex, t->sampling_rate,
+		     t->quantization_bit, t->nchannel, t->baud_rate,
+		     t->carrier_low, t->stop_bit, t->dds);
+    }
+    cache_hash(h, buf, n + 1);
+    for (i = 0; i < t->nsection && !t->cmtfile; i++) {
+	s = &t->program[i];
+	n = snprintf(buf, sizeof(buf), "%c %.17g %ld", s->type, s->length,
+		     s->count);
+	cache_hash(h, buf, n + 1);
+    }
+
+    if (t->intelhex) {
+	for (i = 0; i < t->ihex->nextent; i++) {
+	    e = &t->ihex->extent[i];
+	    n = snprintf(buf, sizeof(buf), "%lx %lu", e->address,
+			 (unsigned long)e->size);
+	    cache_hash(h, buf, n + 1);
+	    cache_hash(h, e->data, e->size);
+	}
+    }else{
+	cache_hash(h, t->in.data, t->in.size);
+    }
+
+    sprintf(key, "%016llx%016llx", h[0], h[1]);
+}
+
+
+/*
+ * The second lane takes every byte inverted, so the lanes do not
+ * collide together on the same pair of inputs.
+ */
+static void cache_hash(unsigned long long *h, const void *data, size_t n)
+{
+    const unsigned char *p = data;
+    const unsigned long long prime = 0x100000001b3ULL;
+
+    for (; n > 0; n--, p++) {
+	h[0] = (h[0] ^ *p) * prime;
+	h[1] = (h[1] ^ (unsigned char)~*p) * prime;
+    }
+}
+
+
+static void cache_path(struct tape *t, char *path)
+{
+    snprintf(path, PATH_MAX, "%s/%s.%s", t->cachedir, t->cachekey,
+	     t->cmtfile ? "cmt" : "wav");
+}
+
+
+/* from one open file to another, by reflink where supported */
+static int cache_copy(int from, int to)
+{
+    char buf[INPUT_CHUNK];
+    ssize_t n, done, written;
+
+#ifdef FICLONE
+    if (ioctl(to, FICLONE, from) == 0) {
+	return 0;
+    }
+#endif
+    while ((n = read(from, buf, sizeof(buf))) != 0) {
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0)
+	    return -1;
+	for (done = 0; done < n; done += written) {
+	    written = write(to, &buf[done], n - done);
+	    if (written < 0 && errno == EINTR) {
+		written = 0;
+		continue;
+	    }
+	    if (written <= 0)
+		return -1;
+	}
+    }
+    return 0;
+}
+
+
+/*
+ * The stats file holds the lifetime counters and is locked while they
+ * and the entries are changed, by threads and processes alike.
+ */
+static int cache_lock(struct tape *t, struct counters *c)
+{
+    int fd;
+    char path[PATH_MAX], buf[128];
+    ssize_t n;
+
+    memset(c, 0, sizeof(*c));
+    snprintf(path, sizeof(path), "%s/stats", t->cachedir);
+    fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+	printf("cannot lock %s\n", path);
+	exit(1);
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    if (n > 0) {
+	buf[n] = '\0';
+	sscanf(buf, "hits %ld misses %ld evictions %ld",
+	       &c->hit, &c->miss, &c->evict);
+    }
+    return fd;
+}
+
+
+static void cache_unlock(int fd, struct counters *c)
+{
+    int n;
+    char buf[128];
+
+    n = snprintf(buf, sizeof(buf), "hits %ld\nmisses %ld\nevictions %ld\n",
+		 c->hit, c->miss, c->evict);
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, buf, n, 0) != n) {
+	fprintf(stderr, "cannot update cache statistics\n");
+    }
+    close(fd);
+}
+
+
+/* the entries of the directory and their total size */
+static struct entry *cache_scan(struct tape *t, int *n, long long *total)
+{
+    int allocated = 0;
+    char path[PATH_MAX];
+    size_t length;
+    struct entry *e = NULL;
+    struct dirent *d;
+    struct stat st;
+    DIR *dir;
+
+    *n = 0;
+    *total = 0;
+    dir = opendir(t->cachedir);
+    if (dir == NULL) {
+	return NULL;
+    }
+    while ((d = readdir(dir)) != NULL) {
+	length = strlen(d->d_name);
+	if (length != 36 || strspn(d->d_name, "0123456789abcdef") != 32
+	    || (strcmp(&d->d_name[32], ".wav") != 0
+		&& strcmp(&d->d_name[32], ".cmt") != 0)) {
+	    continue;
+	}
+	snprintf(path, sizeof(path), "%s/%s", t->cachedir, d->d_name);
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+	    continue;
+	}
+	if (*n == allocated) {
+	    allocated = allocated ? allocated * 2 : 64;
+	    e = realloc(e, allocated * sizeof(struct entry));
+	    if (e == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	    }
+	}
+	strcpy(e[*n].name, d->d_name);
+	e[*n].size = st.st_size;
+	e[*n].mtime = st.st_mtim.tv_sec + st.st_mtim.tv_nsec / 1e9;
+	*total += st.st_size;
+	(*n)++;
+    }
+    closedir(dir);
+    return e;
+}
+
+
+/* least recently used first */
+static int cache_compare(const void *a, const void *b)
+{
+    const struct entry *x = a, *y = b;
+
+    return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
@@ -0,0 +1,151 @@
+/*
+  format.c : format string compiled into a list of tape sections
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "ihex2monl.h"
+
+static void format_error(struct tape *, char *, char *);
+
+
+static void format_error(struct tape *t, char *p, char *message)
+{
+    printf("illegal format \"%s\": %s at column %d\n",
+	   t->format, message, (int)(p - t->format) + 1);
+    exit(1);
+}
+
+
+/*
+ * A format is a list of sections, optionally separated by blanks or
+ * punctuation such as commas:
+ *   b<seconds>  silence
+ *   h<seconds>  leader tone
+ *   d[bytes]    data, the rest of the input if no count is given
+ * The numbers are read as sscanf() did when the string was interpreted
+ * on every run, so existing formats compile to the same sections.
+ */
+void format_compile(struct tape *t)
+{
+    int n = 0;
+    char *p, *end;
+    struct section *s;
+
+    t->nsection = 0;
+    t->program = NULL;
+    for (p = t->format; *p != '\0'; p = end) {
+	if (isspace((unsigned char)*p) || ispunct((unsigned char)*p)) {
+	    end = p + 1;
+	    continue;
+	}
+	if (t->nsection == n) {
+	    n = n ? n * 2 : 8;
+	    t->program = realloc(t->program, n * sizeof(struct section));
+	    if (t->program == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	    }
+	}
+	s = &t->program[t->nsection];
+	s->type = *p;
+	s->length = 0;
+	s->count = 0;
+	s->seconds = 0;
+
+	switch (*p) {
+	  case 'b':
+	  case 'h':
+	    s->length = strtod(p + 1, &end);
+	    if (end == p + 1) {
+		format_error(t, p, "missing length");
+	    }
+	    if (!isfinite(s->length) || s->length < 0) {
+		format_error(t, p, "length out of range");
+	    }
+	    break;
+	  case 'd':
+	    s->count = strtol(p + 1, &end, 10);
+	    if (s->count < 0) {
+		format_error(t, p, "negative byte count");
+	    }
+	    break;
+	  default:
+	    format_error(t, p, "unknown section");
+	}
+	if (*end != '\0' && !isspace((unsigned char)*end)
+	    && !ispunct((unsigned char)*end) && strchr("bhd", *end) == NULL) {
+	    format_error(t, end, "junk after section");
+	}
+	t->nsection++;
+    }
+    if (t->nsection == 0) {
+	format_error(t, p, "no sections");
+    }
+    format_plan(t, -1);
+}
+
+
+/*
+ * Planned length of each section in seconds, as rendered: silence is a
+ * whole number of samples, leader tone a whole number of bits and data
+ * a whole number of framed bytes.  A 'd' section without a count takes
+ * what is left of datasize bytes; with datasize < 0 it is left unknown.
+ * Returns the total, or a negative value if any section is unknown.
+ */
+double format_plan(struct tape *t, long datasize)
+{
+    int i;
+    long n;
+    double total = 0;
+    struct section *s;
+
+    for (i = 0; i < t->nsection; i++) {
+	s = &t->program[i];
+	switch (s->type) {
+	  case 'b':
+	    s->seconds = ceil(s->length * t->sampling_rate) / t->sampling_rate;
+	    break;
+	  case 'h':
+	    s->seconds = ceil(s->length * t->baud_rate) / t->baud_rate;
+	    break;
+	  case 'd':
+	    if (datasize < 0 && s->count == 0) {
+		s->seconds = -1;
+		break;
+	    }
+	    n = datasize < 0 ? s->count
+		: s->count == 0 || s->count > datasize ? datasize : s->count;
+	    if (datasize >= 0)
+		datasize -= n;
+	    s->seconds = (double)n * (9 + t->stop_bit) / t->baud_rate;
+	    break;
+	}
+	if (s->seconds < 0 || total < 0)
+	    total = -1;
+	else
+	    total += s->seconds;
+    }
+    return total;
+}
+
+
+/* bytes of datasize that the 'd' sections take, in order */
+long format_data(struct tape *t, long datasize)
+{
+    int i;
+    long n = 0;
+    struct section *s;
+
+    for (i = 0; i < t->nsection; i++) {
+	s = &t->program[i];
+	if (s->type == 'd') {
+	    n += s->count == 0 || s->count > datasize - n
+		? datasize - n : s->count;
+	}
+    }
+    return n;
+}
@@ -0,0 +1,225 @@
+/*
+  ihex2monl.h : state shared by the converter modules
+*/
+
+#ifndef _IHEX2MONL_H_
+#define _IHEX2MONL_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define OUTPUT_CHUNK (256 * 1024)
+#define INPUT_CHUNK (64 * 1024)
+#define CACHE_SIZE (1024LL * 1024 * 1024)	/* default --cache-size */
+
+#define FORMAT_DEFAULT "b2.0 h3.5 d16 h0.5 d h0.05 b0.6"
+#define FORMAT_IO "b2.0 h3.5 d17 h0.05 b3.5 h3.5 d h0.05 b0.6"
+#define FORMAT_BIN "b2.0 h3.5 d h0.05 b0.6"
+
+/* stages timed for --stats */
+enum stage {
+    STAGE_INPUT,	/* reading or mapping the input file */
+    STAGE_PARSE,	/* Intel HEX to image and mon byte stream */
+    STAGE_COUNT,	/* the counting pass */
+    STAGE_SYNTHESIS,	/* rendering, less the time spent writing */
+    STAGE_WRITE,	/* opening, preallocating and writing the output */
+    NSTAGE
+};
+
+/* contiguous run of bytes in an Intel HEX image */
+struct extent {
+    unsigned long address;
+    size_t size;
+    size_t allocated;
+    unsigned char *data;
+};
+
+/* Intel HEX image and the mon byte stream generated from it */
+struct ihex {
+    unsigned long start;	/* lowest address */
+    long size;		/* bytes up to the highest address */
+    struct extent *extent;	/* sorted, neither adjacent nor overlapping */
+    int nextent;
+    int allocated;
+
+    /* mon tape byte stream, framing interleaved with extent data */
+    struct iovec *iov;
+    int niov;
+    int iovallocated;
+    unsigned char *frame;
+    size_t frameallocated;
+    size_t monsize;
+
+    /* counted while reading, for --stats */
+    long nrecord[6];	/* records by type */
+    long long payload;	/* bytes of DATA records */
+    long nblock;	/* mon data blocks */
+};
+
+/* input file contents */
+struct input {
+    unsigned char *data;
+    size_t size;
+    int mapped;		/* data is an mmap of the file */
+};
+
+/* output arena, flushed in large chunks by a writer thread */
+struct output {
+    char *data;		/* being filled */
+    size_t length;
+    size_t size;
+    char *spare;	/* the other buffer, free or being written */
+    size_t sparesize;
+
+    /* writer thread, started with the first write */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int started;
+    char *pending;	/* handed to the writer, NULL when it is idle */
+    size_t npending;
+    int fd;
+    char *name;		/* output file, for errors */
+
+    /* counted by the writer, read once it is idle */
+    long nwrite;	/* write calls */
+    long long nbyte;	/* bytes written */
+    double wall;	/* seconds spent writing */
+    double cpu;
+    double wait;	/* seconds the synthesis waited for the writer */
+};
+
+/* waveform cache */
+struct wave_cell {
+    int nsample;
+    double *offset;	/* offset of each sample from the bit start */
+    double *margin;	/* distance of each sample value from a rounding step */
+    char *data;		/* rendered samples, all channels */
+    double low, high;	/* range of offset[i] - i / sampling_rate */
+    int *fragile;	/* samples close to a rounding step, then nsample */
+    double least;	/* smallest margin of the other samples */
+};
+
+struct wave_cache {
+    int sampling_rate;
+    int baud_rate;
+    int carrier_low;
+    int quantization_bit;
+    int nchannel;
+    int step;		/* gcd of sampling rate and carrier frequency */
+    int ncell;
+    struct wave_cell **cell[2];
+    char *sine[2];	/* carrier low and high for wave_dds_bit() */
+    int nsine[2];	/* their periods in samples */
+    struct wave_cache *next;
+};
+
+/* one section of a compiled format string */
+struct section {
+    char type;		/* 'b' silence, 'h' leader tone, 'd' data */
+    double length;	/* seconds of 'b' and 'h' */
+    long count;		/* bytes of 'd', 0 for the rest */
+    double seconds;	/* planned duration, see format_plan() */
+};
+
+/* one conversion job */
+struct tape {
+    /* file type */
+    int cmtfile;
+
+    /* wav file parameter */
+    int sampling_rate;
+    int quantization_bit;
+    int nchannel;
+
+    /* tape parameter */
+    int baud_rate;
+    int carrier_low;
+    char *format;
+    struct section *program;	/* compiled format */
+    int nsection;
+    int stop_bit;
+    int intelhex;
+    int dds;
+    int verbose;
+    int dryrun;
+    int stats;		/* --stats: 1 text, 2 JSON */
+    int verify;		/* read the output back instead of writing it */
+    char *cachedir;	/* --cache */
+    long long cachesize;
+
+    /* batch parameter, command line only */
+    char *manifest;
+    int nthread;
+
+    /* files and result */
+    char *input;
+    char *output;
+    long long size;
+    double seconds;
+
+    /* conversion state */
+    double time;
+    long long tick;	/* sample number, with -D */
+    struct input in;
+    long nalloc;	/* allocations while generating */
+    long long nread;	/* input bytes */
+    long long nbit;	/* bits rendered */
+    double wall[NSTAGE];	/* seconds per stage, for --stats */
+    double cpu[NSTAGE];
+    int cachehit;	/* 1 hit, 0 miss, -1 not cached */
+    char cachekey[33];
+    struct wave_cache *cache;
+
+    /* owned by the worker running the job */
+    struct ihex *ihex;
+    struct output *out;
+    struct wave_cache **caches;
+};
+
+/* tape.c */
+long long generate(struct tape *, FILE *);
+int wav_head_size(struct tape *);
+void wav_head(struct tape *, long long, FILE *);
+char *output(struct tape *, size_t, FILE *);
+void output_flush(struct tape *, FILE *);
+void *alloc(struct tape *, size_t);
+
+/* format.c */
+void format_compile(struct tape *);
+double format_plan(struct tape *, long);
+long format_data(struct tape *, long);
+
+/* input.c */
+void input_open(struct input *, char *);
+void input_close(struct input *);
+void input_release(struct input *, size_t);
+
+/* wave.c */
+struct wave_cell *wave_cell(struct tape *, double, double);
+void wave_sample(struct tape *, struct wave_cell *, int, double, double);
+void wave_bound(struct tape *, struct wave_cell *);
+int wave_dds_bit(struct tape *, double, char *);
+void wave_format(struct tape *, const double *, int, char *);
+
+/* stats.c */
+double now(void);
+double cputime(void);
+void stats_stage(struct tape *, enum stage, double *, double *);
+void stats_print(struct tape *);
+
+/* cache.c */
+int cache_fetch(struct tape *);
+void cache_store(struct tape *);
+void cache_report(struct tape *, int, int);
+
+/* verify.c */
+void verify(struct tape *);
+
+/* readihex.c */
+void readihex(struct ihex *, const char *, size_t);
+void encodeihex(struct ihex *);
+
+#endif /* _IHEX2MONL_H_ */
@@ -0,0 +1,162 @@
+/*
+  input.c : whole input file in memory, mapped when possible
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ihex2monl.h"
+
+static int input_map(struct input *, int);
+static void input_spool(int, int, char *);
+static void input_read(struct input *, int, char *);
+
+
+/*
+ * Regular files are mapped read-only.  Pipes and terminals are copied to
+ * an unlinked temporary file a chunk at a time and that is mapped, so
+ * every input ends up as one block of memory that the parsers scan
+ * directly, while the process itself only holds a chunk of it.  Only
+ * when no temporary file can be made is the input read into a growing
+ * buffer.
+ */
+void input_open(struct input *in, char *name)
+{
+    int fd;
+    FILE *spool;
+
+    in->data = NULL;
+    in->size = 0;
+    in->mapped = 0;
+
+    if (strcmp(name, "-") == 0) {
+	fd = 0;
+    }else{
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+	    printf("cannot open %s\n", name);
+	    exit(1);
+	}
+    }
+
+    if (input_map(in, fd) == 0) {
+	spool = tmpfile();
+	if (spool != NULL) {
+	    input_spool(fd, fileno(spool), name);
+	    input_map(in, fileno(spool));
+	    fclose(spool);
+	}
+	if (!in->mapped)
+	    input_read(in, fd, name);
+    }
+
+    if (fd != 0)
+	close(fd);
+}
+
+
+/* maps a regular file, returns 0 if it is not one or cannot be mapped */
+static int input_map(struct input *in, int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+	|| lseek(fd, 0, SEEK_CUR) != 0) {
+	return 0;
+    }
+    in->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (in->data == MAP_FAILED) {
+	in->data = NULL;
+	return 0;
+    }
+    madvise(in->data, st.st_size, MADV_SEQUENTIAL);
+    in->size = st.st_size;
+    in->mapped = 1;
+    return 1;
+}
+
+
+/* copies the rest of fd to the spool file */
+static void input_spool(int fd, int spool, char *name)
+{
+    char buf[INPUT_CHUNK];
+    ssize_t n, done, written;
+
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0) {
+	    printf("cannot read %s\n", name);
+	    exit(1);
+	}
+	for (done = 0; done < n; done += written) {
+	    written = write(spool, &buf[done], n - done);
+	    if (written < 0 && errno == EINTR) {
+		written = 0;
+		continue;
+	    }
+	    if (written <= 0) {
+		printf("cannot write temporary file\n");
+		exit(1);
+	    }
+	}
+    }
+    lseek(spool, 0, SEEK_SET);
+}
+
+
+/* reads the rest of fd into a growing buffer */
+static void input_read(struct input *in, int fd, char *name)
+{
+    ssize_t n;
+    size_t allocated;
+
+    for (allocated = 0; ; in->size += n) {
+	if (in->size == allocated) {
+	    allocated = allocated ? allocated * 2 : INPUT_CHUNK;
+	    in->data = realloc(in->data, allocated);
+	    if (in->data == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	    }
+	}
+	n = read(fd, in->data + in->size, allocated - in->size);
+	if (n < 0) {
+	    printf("cannot read %s\n", name);
+	    exit(1);
+	}
+	if (n == 0)
+	    break;
+    }
+}
+
+
+void input_close(struct input *in)
+{
+    if (in->mapped)
+	munmap(in->data, in->size);
+    else
+	free(in->data);
+    in->data = NULL;
+    in->size = 0;
+}
+
+
+/*
+ * Gives back the mapped pages below pos once they have been consumed, so
+ * that streaming through a large raw input does not keep all of it
+ * resident.  They are read again from the file if needed.
+ */
+void input_release(struct input *in, size_t pos)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (in->mapped && pos / page > 0) {
+	madvise(in->data, pos / page * page, MADV_DONTNEED);
+    }
+}
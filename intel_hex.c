@@ -5,8 +5,14 @@
  * http://github.com/alhirzel/intel_hex_files
  */
 
+#include <string.h>
 #include "intel_hex.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HEX_DECODE_X86
+#endif
+
 
 
 /* States for the simple state machine used in 'slurp_next_intel_hex_record'.
@@ -35,20 +41,75 @@ enum slurp_state {
 
 
 /* Local utility functions. (See below for documentation.) */
-static enum intel_hex_slurp_error slurp8bits(char (*)(void), uint8_t *, uint16_t *);
-static enum intel_hex_slurp_error slurp16bits(char (*)(void), uint16_t *, uint16_t *);
-static enum intel_hex_slurp_error slurp_bytes(int, char (*)(void), uint8_t (*)[], uint16_t *);
+static char next_char(struct intel_hex_parser *);
+static char slurp_legacy_char(void *);
+static int slurp_buffer_record(struct intel_hex_parser *, struct intel_hex_record *);
+static int decode_hex(const uint8_t *, uint8_t *, int, unsigned int *);
+static int decode_hex_scalar(const uint8_t *, uint8_t *, int, unsigned int *);
+#ifdef HEX_DECODE_X86
+static int decode_hex_sse2(const uint8_t *, uint8_t *, int, unsigned int *);
+static int decode_hex_avx2(const uint8_t *, uint8_t *, int, unsigned int *);
+#endif
+static enum intel_hex_slurp_error slurp8bits(struct intel_hex_parser *, uint8_t *, uint16_t *);
+static enum intel_hex_slurp_error slurp16bits(struct intel_hex_parser *, uint16_t *, uint16_t *);
+static enum intel_hex_slurp_error slurp_bytes(int, struct intel_hex_parser *, uint8_t (*)[], uint16_t *);
+
+
+
+/* (See header for documentation.) */
+void intel_hex_parser_init(struct intel_hex_parser *p, char (*slurp_char)(void *user), void *user) {
+	p->slurp_char = slurp_char;
+	p->user = user;
+	p->buffer = NULL;
+	p->length = 0;
+	p->position = 0;
+}
 
 
 
+/* (See header for documentation.) */
+void intel_hex_parser_init_buffer(struct intel_hex_parser *p, const char *buffer, size_t length) {
+	p->slurp_char = NULL;
+	p->user = NULL;
+	p->buffer = buffer;
+	p->length = length;
+	p->position = 0;
+}
+
+
+
+/* Holds the callback of a slurp_next_intel_hex_record call so it can be
+ * handed to the parser as its user pointer. */
+struct legacy_source {
+	char (*slurp_char)(void);
+};
+
 /* (See header for documentation.) */
 enum intel_hex_slurp_error slurp_next_intel_hex_record(char (*slurp_char)(void), struct intel_hex_record *r) {
+	struct legacy_source source;
+	struct intel_hex_parser p;
+
+	source.slurp_char = slurp_char;
+	intel_hex_parser_init(&p, &slurp_legacy_char, &source);
+	return intel_hex_parse_record(&p, r);
+}
+
+
+
+/* (See header for documentation.) */
+enum intel_hex_slurp_error intel_hex_parse_record(struct intel_hex_parser *p, struct intel_hex_record *r) {
 	enum slurp_state state = SLURP_INIT;
 	enum intel_hex_slurp_error err = SLURP_ERROR_NONE;
 	uint16_t checksum = 0;
 	uint8_t checksum_read;
 	char colon;
 
+	/* Complete records in a buffer are decoded directly. Anything unusual
+	 * is left to the state machine, which reports the error. */
+	if (NULL == p->slurp_char && slurp_buffer_record(p, r)) {
+		return SLURP_ERROR_NONE;
+	}
+
 	/* State machine has two tracking variables:
 	 *
 	 *   * state - next state to proceed to assuming no error condition
@@ -69,7 +130,7 @@ enum intel_hex_slurp_error slurp_next_intel_hex_record(char (*slurp_char)(void),
 			 * colon character. This frames the ASCII record ahead of the
 			 * remainder of the parsing process. */
 			case SLURP_READ_COLON_OR_LINE_BREAK:
-				colon = (*slurp_char)();
+				colon = next_char(p);
 				if (':' == colon) {
 					state = SLURP_READ_BYTE_COUNT;
 				} else if (('\r' == colon) || ('\n' == colon)) {
@@ -82,21 +143,21 @@ enum intel_hex_slurp_error slurp_next_intel_hex_record(char (*slurp_char)(void),
 			/* Reads two ASCII character byte count. This is validated after
 			 * reading the record type. */
 			case SLURP_READ_BYTE_COUNT:
-				err = slurp8bits(slurp_char, &(r->byte_count), &checksum);
+				err = slurp8bits(p, &(r->byte_count), &checksum);
 				state = SLURP_READ_ADDRESS;
 				break;
 
 			/* Reads four ASCII character address. This is validated after
 			 * reading the record type. */
 			case SLURP_READ_ADDRESS:
-				err = slurp16bits(slurp_char, &(r->address), &checksum);
+				err = slurp16bits(p, &(r->address), &checksum);
 				state = SLURP_READ_RECORD_TYPE;
 				break;
 
 			/* Reads two ASCII character record type and branch to proper
 			 * validation depending on the record type's requirements. */
 			case SLURP_READ_RECORD_TYPE:
-				err = slurp8bits(slurp_char, &(r->record_type), &checksum);
+				err = slurp8bits(p, &(r->record_type), &checksum);
 				switch (r->record_type) {
 					case DATA_RECORD:
 					case EOF_RECORD:  state = SLURP_READ_DATA;               break;
@@ -131,7 +192,7 @@ enum intel_hex_slurp_error slurp_next_intel_hex_record(char (*slurp_char)(void),
 			 * for ESA is required to simplify structure of the state machine
 			 * at the cost of some code duplication. */
 			case SLURP_READ_ESA_DATA:
-				err = slurp_bytes(2, slurp_char, &(r->data), &checksum);
+				err = slurp_bytes(2, p, &(r->data), &checksum);
 				state = SLURP_VERIFY_ESA_DATA_FORMAT_IS_PROPER_ADDRESS;
 				break;
 
@@ -208,14 +269,14 @@ enum intel_hex_slurp_error slurp_next_intel_hex_record(char (*slurp_char)(void),
 			/* Reads pairs of ASCII characters according to the data length
 			 * field. */
 			case SLURP_READ_DATA:
-				err = slurp_bytes(r->byte_count, slurp_char, &(r->data), &checksum);
+				err = slurp_bytes(r->byte_count, p, &(r->data), &checksum);
 				state = SLURP_READ_CHECKSUM;
 				break;
 
 			/* Reads two ASCII character checksum field and adds it in to the
 			 * rest of the checksum. */
 			case SLURP_READ_CHECKSUM:
-				err = slurp8bits(slurp_char, &checksum_read, &checksum);
+				err = slurp8bits(p, &checksum_read, &checksum);
 				state = SLURP_VERIFY_CHECKSUM;
 				break;
 
@@ -242,15 +303,236 @@ enum intel_hex_slurp_error slurp_next_intel_hex_record(char (*slurp_char)(void),
 
 
 
+/* Next character from the parser's callback or buffer. Past the end of a
+ * buffer this is (char) EOF, like getc() based callbacks return. */
+static char next_char(struct intel_hex_parser *p) {
+	if (NULL != p->slurp_char) {
+		return (*p->slurp_char)(p->user);
+	}
+	if (p->position < p->length) {
+		return p->buffer[p->position++];
+	}
+	return (char) -1;
+}
+
+
+
+/* Value of each hexadecimal digit with bit 4 set; zero for any other
+ * character. */
+static const uint8_t hex_digit[256] = {
+	['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13,
+	['4'] = 0x14, ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17,
+	['8'] = 0x18, ['9'] = 0x19,
+	['A'] = 0x1A, ['B'] = 0x1B, ['C'] = 0x1C, ['D'] = 0x1D,
+	['E'] = 0x1E, ['F'] = 0x1F,
+	['a'] = 0x1A, ['b'] = 0x1B, ['c'] = 0x1C, ['d'] = 0x1D,
+	['e'] = 0x1E, ['f'] = 0x1F
+};
+
+
+
+/* Decodes one whole record straight from the parser's buffer with the
+ * hex_digit table. Returns nonzero on success. Returns zero, consuming
+ * nothing, if the record is incomplete, malformed or fails any check the
+ * state machine makes, so that the state machine can parse it and report the
+ * same error it always has. */
+static int slurp_buffer_record(struct intel_hex_parser *p, struct intel_hex_record *r) {
+	const uint8_t *s = (const uint8_t *) p->buffer + p->position;
+	const uint8_t *end = (const uint8_t *) p->buffer + p->length;
+	uint8_t bytes[4 + UINT8_MAX + 1];
+	uint8_t hi, lo;
+	unsigned int checksum = 0;
+	int n;
+
+	while (s < end && ('\r' == *s || '\n' == *s)) {
+		s++;
+	}
+	if (end - s < 3 || ':' != *s) {
+		return 0;
+	}
+	s++;
+
+	/* Byte count first, to know the record length: count, address (2),
+	 * type, data and checksum. */
+	hi = hex_digit[s[0]];
+	lo = hex_digit[s[1]];
+	if (0 == (hi & lo & 0x10)) {
+		return 0;
+	}
+	n = 5 + (uint8_t) ((hi << 4) | (lo & 0x0F));
+	if (end - s < 2 * n) {
+		return 0;
+	}
+
+	/* Header, data payload and checksum; the payload may be long enough
+	 * for the vector kernels. */
+	if (!decode_hex_scalar(s, bytes, 4, &checksum)
+			|| !decode_hex(s + 8, bytes + 4, n - 5, &checksum)
+			|| !decode_hex_scalar(s + 2 * n - 2, bytes + n - 1, 1, &checksum)) {
+		return 0;
+	}
+	if (0 != (checksum & 0xFF)) {
+		return 0;
+	}
+
+	switch (bytes[3]) {
+		case DATA_RECORD:
+		case EOF_RECORD:
+			break;
+		case ESA_RECORD:
+			if (0 != bytes[1] || 0 != bytes[2] || 2 != bytes[0] || 0 != (bytes[5] & 0x0F)) {
+				return 0;
+			}
+			break;
+		case SSA_RECORD:
+		case SLA_RECORD:
+			if (0 != bytes[1] || 0 != bytes[2] || 4 != bytes[0]) {
+				return 0;
+			}
+			break;
+		case ELA_RECORD:
+			if (0 != bytes[1] || 0 != bytes[2] || 2 != bytes[0]) {
+				return 0;
+			}
+			break;
+		default:
+			return 0;
+	}
+
+	r->byte_count = bytes[0];
+	r->address = ((uint16_t) bytes[1] << 8) | bytes[2];
+	r->record_type = bytes[3];
+	memcpy(r->data, &bytes[4], bytes[0]);
+	p->position = (const char *) s + 2 * n - p->buffer;
+	return 1;
+}
+
+
+
+/* Decodes n bytes from 2n hex digits at s into out and adds them to *sum.
+ * Returns zero if any character is not a hex digit. Picks the widest kernel
+ * the CPU supports; all of them give the same result. */
+static int decode_hex(const uint8_t *s, uint8_t *out, int n, unsigned int *sum) {
+#ifdef HEX_DECODE_X86
+	if (n >= 16 && __builtin_cpu_supports("avx2")) {
+		return decode_hex_avx2(s, out, n, sum);
+	}
+	if (n >= 8 && __builtin_cpu_supports("sse2")) {
+		return decode_hex_sse2(s, out, n, sum);
+	}
+#endif
+	return decode_hex_scalar(s, out, n, sum);
+}
+
+
+
+static int decode_hex_scalar(const uint8_t *s, uint8_t *out, int n, unsigned int *sum) {
+	uint8_t hi, lo;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		hi = hex_digit[s[2 * i]];
+		lo = hex_digit[s[2 * i + 1]];
+		if (0 == (hi & lo & 0x10)) {
+			return 0;
+		}
+		out[i] = (hi << 4) | (lo & 0x0F);
+		*sum += out[i];
+	}
+	return 1;
+}
+
+
+
+#ifdef HEX_DECODE_X86
+/* The kernels classify 16 or 32 characters at once with signed compares
+ * (bytes above 0x7F are negative, so never in range), convert digits and
+ * letters to nibbles, then combine each pair of nibbles in a 16-bit lane
+ * and pack the lanes back to bytes. The checksum is accumulated with a sum
+ * of absolute differences against zero. Leftover characters go through the
+ * scalar loop. */
+__attribute__((target("sse2")))
+static int decode_hex_sse2(const uint8_t *s, uint8_t *out, int n, unsigned int *sum) {
+	__m128i total = _mm_setzero_si128();
+	__m128i c, l, digit, letter, v, b;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		c = _mm_loadu_si128((const __m128i *) (s + 2 * i));
+		l = _mm_or_si128(c, _mm_set1_epi8(0x20));
+		digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+				_mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+		letter = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+				_mm_cmplt_epi8(l, _mm_set1_epi8('f' + 1)));
+		if (0xFFFF != _mm_movemask_epi8(_mm_or_si128(digit, letter))) {
+			return 0;
+		}
+		v = _mm_or_si128(
+				_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+				_mm_and_si128(letter, _mm_sub_epi8(l, _mm_set1_epi8('a' - 10))));
+		v = _mm_or_si128(
+				_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00FF)), 4),
+				_mm_srli_epi16(v, 8));
+		b = _mm_packus_epi16(v, _mm_setzero_si128());
+		_mm_storel_epi64((__m128i *) (out + i), b);
+		total = _mm_add_epi64(total, _mm_sad_epu8(b, _mm_setzero_si128()));
+	}
+	*sum += _mm_cvtsi128_si32(total);
+	return decode_hex_scalar(s + 2 * i, out + i, n - i, sum);
+}
+
+
+
+__attribute__((target("avx2")))
+static int decode_hex_avx2(const uint8_t *s, uint8_t *out, int n, unsigned int *sum) {
+	__m128i total = _mm_setzero_si128();
+	__m256i c, l, digit, letter, v;
+	__m128i b;
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		c = _mm256_loadu_si256((const __m256i *) (s + 2 * i));
+		l = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+		digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+				_mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+		letter = _mm256_and_si256(_mm256_cmpgt_epi8(l, _mm256_set1_epi8('a' - 1)),
+				_mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), l));
+		if (-1 != _mm256_movemask_epi8(_mm256_or_si256(digit, letter))) {
+			return 0;
+		}
+		v = _mm256_or_si256(
+				_mm256_and_si256(digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+				_mm256_and_si256(letter, _mm256_sub_epi8(l, _mm256_set1_epi8('a' - 10))));
+		v = _mm256_or_si256(
+				_mm256_slli_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0x00FF)), 4),
+				_mm256_srli_epi16(v, 8));
+		b = _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+		_mm_storeu_si128((__m128i *) (out + i), b);
+		total = _mm_add_epi64(total, _mm_sad_epu8(b, _mm_setzero_si128()));
+	}
+	*sum += _mm_cvtsi128_si32(total) + _mm_extract_epi16(total, 4);
+	return decode_hex_scalar(s + 2 * i, out + i, n - i, sum);
+}
+#endif
+
+
+
+/* Calls the callback given to slurp_next_intel_hex_record. */
+static char slurp_legacy_char(void *user) {
+	return (*((struct legacy_source *) user)->slurp_char)();
+}
+
+
+
 /* TODO */
-static enum intel_hex_slurp_error slurp8bits(char (*slurp_char)(void), uint8_t *dest, uint16_t *checksum) {
+static enum intel_hex_slurp_error slurp8bits(struct intel_hex_parser *p, uint8_t *dest, uint16_t *checksum) {
 	char temp;
 	int i;
 
 	/* TODO */
 	*((uint8_t *) dest) = 0;
 	for (i = 4; i >= 0; i -= 4) {
-		switch ((*slurp_char)()) {
+		switch (next_char(p)) {
 			case '0': temp = 0x0; break;
 			case '1': temp = 0x1; break;
 			case '2': temp = 0x2; break;
@@ -288,13 +570,13 @@ static enum intel_hex_slurp_error slurp8bits(char (*slurp_char)(void), uint8_t *
 
 
 /* Slurp two 8-bit values and combine them. */
-static enum intel_hex_slurp_error slurp16bits(char (*slurp_char)(void), uint16_t *dest, uint16_t *checksum) {
+static enum intel_hex_slurp_error slurp16bits(struct intel_hex_parser *p, uint16_t *dest, uint16_t *checksum) {
 	uint8_t b1, b2;
 	enum intel_hex_slurp_error err;
 
-	err = slurp8bits(slurp_char, &b1, checksum);
+	err = slurp8bits(p, &b1, checksum);
 	if (SLURP_ERROR_NONE == err) {
-		err = slurp8bits(slurp_char, &b2, checksum);
+		err = slurp8bits(p, &b2, checksum);
 		if (SLURP_ERROR_NONE == err) {
 			*dest = b1;
 			*dest <<= 8;
@@ -308,12 +590,12 @@ static enum intel_hex_slurp_error slurp16bits(char (*slurp_char)(void), uint16_t
 
 
 /* TODO */
-static enum intel_hex_slurp_error slurp_bytes(int nbytes, char (*slurp_char)(void), uint8_t (*dest)[], uint16_t *checksum) {
+static enum intel_hex_slurp_error slurp_bytes(int nbytes, struct intel_hex_parser *p, uint8_t (*dest)[], uint16_t *checksum) {
 	enum intel_hex_slurp_error err = SLURP_ERROR_NONE;
 	int i;
 
 	for (i = 0; i < nbytes; i++) {
-		err = slurp8bits(slurp_char, &((*dest)[i]), checksum);
+		err = slurp8bits(p, &((*dest)[i]), checksum);
 		if (SLURP_ERROR_NONE != err) {
 			break;
 		}
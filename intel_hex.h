@@ -8,6 +8,7 @@
 #ifndef _INTEL_HEX_H_
 #define _INTEL_HEX_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* Different possible records for Intel .hex files. */
@@ -77,9 +78,51 @@ enum intel_hex_slurp_error {
 	SLURP_ERROR_SLA_BYTE_COUNT_NOT_FOUR
 };
 
+/* Parser state for reentrant use. Each stream being parsed has its own
+ * parser, so several streams can be parsed at the same time. Characters come
+ * either from a callback, which is handed the 'user' pointer, or from a
+ * memory buffer. Initialize with one of the intel_hex_parser_init functions;
+ * the fields are private to the parser. */
+struct intel_hex_parser {
+	char (*slurp_char)(void *user);
+	void *user;
+	const char *buffer;
+	size_t length;
+	size_t position;
+};
+
+/* Sets up a parser reading characters from a callback.
+ *
+ * Arguments: p          - parser to initialize
+ *            slurp_char - function to retrieve next character, given 'user'
+ *            user       - pointer handed to every call of slurp_char
+ */
+void intel_hex_parser_init(struct intel_hex_parser *p, char (*slurp_char)(void *user), void *user);
+
+/* Sets up a parser reading characters from a memory buffer. Reading past the
+ * end yields the same error as reading past the end of a file.
+ *
+ * Arguments: p      - parser to initialize
+ *            buffer - Intel .hex text, which must outlive the parser
+ *            length - number of characters in buffer
+ */
+void intel_hex_parser_init_buffer(struct intel_hex_parser *p, const char *buffer, size_t length);
+
 /* Returns valid, populated 'intel_hex_record' structure. Fails on any error
  * including invalid checksum.
  *
+ * Arguments: p - parser to read the next record from
+ *            r - allocated 'intel_hex_record' object to overwrite
+ *
+ * Return:    Either SLURP_ERROR_NONE in the case of success or a different item
+ *            of intel_hex_slurp_error in the case of failure.
+ */
+enum intel_hex_slurp_error intel_hex_parse_record(struct intel_hex_parser *p, struct intel_hex_record *r);
+
+/* Returns valid, populated 'intel_hex_record' structure. Fails on any error
+ * including invalid checksum. Equivalent to intel_hex_parse_record with a
+ * parser around slurp_char; kept for existing callers.
+ *
  * Arguments: slurp_char - function to retrieve next character
  *            r          - allocated 'intel_hex_record' object to overwrite
  *
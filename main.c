@@ -6,219 +6,451 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
-
-#ifndef M_PI
-#define M_PI 3.141592653589793
-#endif
-
-#define FORMAT_DEFAULT "b2.0 h3.5 d16 h0.5 d h0.05 b0.6"
-#define FORMAT_IO "b2.0 h3.5 d17 h0.05 b3.5 h3.5 d h0.05 b0.6"
-#define FORMAT_BIN "b2.0 h3.5 d h0.05 b0.6"
-
-void wav_head(int, FILE *);
-int option(int, char *[]);
-int dataout(char, FILE *);
-int header(double, FILE *);
-int fsk(double, FILE *);
-int blank(double, FILE *);
-void fput2(int, FILE *);
-void fput4(int, FILE *);
-
-void readihex(FILE *);
-int getihex();
-
-/* file type */
-int cmtfile;
-
-/* wav file parameter */
-int sampling_rate;
-int quantization_bit;
-int nchannel;
-
-/* tape parameter */
-int baud_rate;
-int carrier_low;
-char *format;
-double time;
-int stop_bit;
-int intelhex;
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "ihex2monl.h"
+
+#define MANIFEST_ARGS 64
+
+/* batch conversion */
+struct queue {
+    pthread_mutex_t lock;
+    struct tape *jobs;
+    int njob;
+    int next;		/* first job not yet taken */
+};
+
+/* state owned by one conversion thread, reused from job to job */
+struct worker {
+    pthread_t thread;
+    struct queue *queue;
+    struct ihex ihex;
+    struct output out;
+    struct wave_cache *caches;
+};
+
+int option(struct tape *, int, char *[]);
+void convert(struct tape *);
+void preallocate(struct tape *, FILE *);
+void addjob(struct queue *, struct tape *, char *, char *);
+void batch(struct queue *, struct tape *);
+void *work(void *);
 
 int main(int argc, char *argv[])
 {
-    int i, j;
-    int c;
-    int size = 0;
-    FILE *fp_in, *fp_out;
+    int i, j, n, hit, miss;
+    long long size;
+    double seconds, start;
+    struct tape param;
+    struct queue queue;
+    struct worker *workers;
 
     /* default parameter */
 
-    sampling_rate = 11025;
-    quantization_bit = 8;
-    nchannel = 1;
-    baud_rate = 600;
-    carrier_low = 1200;
-    stop_bit = 3;
-    format = NULL;
-    intelhex = 0;
-    cmtfile = 0;
+    memset(&param, 0, sizeof(param));
+    param.sampling_rate = 11025;
+    param.quantization_bit = 8;
+    param.nchannel = 1;
+    param.baud_rate = 600;
+    param.carrier_low = 1200;
+    param.stop_bit = 3;
+    param.format = NULL;
+    param.intelhex = 0;
+    param.cmtfile = 0;
+    param.verbose = 0;
+    param.manifest = NULL;
+    param.cachedir = NULL;
+    param.cachesize = CACHE_SIZE;
+    param.cachehit = -1;
+    param.nthread = sysconf(_SC_NPROCESSORS_ONLN);
 
     /* option analysis */
 
-    if (option(argc, argv) != argc - 2) {
-	printf("usage: p6towav [options] input-file output-file\n");
+    i = option(&param, argc, argv);
+    if ((argc - i) % 2 != 0 || (param.manifest == NULL && i == argc)) {
+	printf("usage: p6towav [options] input-file output-file ...\n");
         printf("options:\n");
 	printf(" -b baud-rate\n");
 	printf(" -c channels\n");
 	printf(" -f format-string | io | bin\n");
-	printf(" -q quantization-bits\n");
+	printf(" -q quantization-bits: 8, 16, 24 or 32 (float)\n");
 	printf(" -r sampling-rate\n");
 	printf(" -s stop-bits\n");
 	printf(" -w lower-carrier-wave\n");
+	printf(" -j threads for batch conversion\n");
+	printf(" -m manifest of \"[options] input-file output-file\" lines\n");
 	printf(" -C cmt file output\n");
+	printf(" -D integer oscillator with exact bit timing\n");
+	printf(" -v print statistics to stderr\n");
+	printf(" -V verify output-file against input-file instead of writing it\n");
+	printf(" -n, --dry-run print the output size and duration only\n");
+	printf(" --stats[=json] print counters and stage times to stderr\n");
+	printf(" --cache=directory keep outputs for repeated conversions\n");
+	printf(" --cache-size=megabytes bound of the cache directory\n");
 	printf("default: -b %d -c %d -f \"%s\" -q %d -r %d -s %d -w %d\n",
-	       baud_rate, nchannel, FORMAT_DEFAULT, quantization_bit,
-	       sampling_rate, stop_bit, carrier_low);
+	       param.baud_rate, param.nchannel, FORMAT_DEFAULT,
+	       param.quantization_bit, param.sampling_rate, param.stop_bit,
+	       param.carrier_low);
 	exit(1);
     }
 
-    /* input file */
+    /* collect jobs */
 
-    if (strcmp(argv[argc - 2], "-") == 0) {
-	fp_in = stdin;
-    }else{
-	fp_in = fopen(argv[argc - 2], "rb");  /* b for Windows */
-	if (fp_in == NULL) {
-	    printf("cannot open %s\n", argv[argc - 2]);
-	    exit(1);
-	}
-        if (intelhex)
-            readihex(fp_in);
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.lock, NULL);
+    for (; i < argc; i += 2) {
+	addjob(&queue, &param, argv[i], argv[i + 1]);
+    }
+    if (param.manifest != NULL) {
+	batch(&queue, &param);
     }
 
-    /* output file */
+    /* run them, one worker per thread */
 
-    if (strcmp(argv[argc - 1], "-") == 0) {
-	fp_out = stdout;
+    n = param.nthread < queue.njob ? param.nthread : queue.njob;
+    if (n < 1) {
+	n = 1;
+    }
+    workers = calloc(n, sizeof(struct worker));
+    if (workers == NULL) {
+	printf("cannot allocate memory\n");
+	exit(1);
+    }
+    start = now();
+    if (n == 1) {
+	workers[0].queue = &queue;
+	work(&workers[0]);
     }else{
-	fp_out = fopen(argv[argc - 1], "wb");  /* b for Windows */
-	if (fp_out == NULL) {
-	    printf("cannot open %s\n", argv[argc - 1]);
-	    exit(1);
+	for (i = 0; i < n; i++) {
+	    workers[i].queue = &queue;
+	    if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+		printf("cannot create thread\n");
+		exit(1);
+	    }
+	}
+	for (i = 0; i < n; i++) {
+	    pthread_join(workers[i].thread, NULL);
 	}
     }
 
-    /* make wav data */
-
-    for (i = 0; i < 44; i++) {
-	if (!cmtfile)
-	    fputc(0, fp_out);
+    if (queue.njob > 1) {
+	size = 0;
+	seconds = 0;
+	for (i = 0; i < queue.njob; i++) {
+	    fprintf(stderr, "%s -> %s: %lld bytes, %.3f s\n",
+		    queue.jobs[i].input, queue.jobs[i].output,
+		    queue.jobs[i].size, queue.jobs[i].seconds);
+	    size += queue.jobs[i].size;
+	    seconds += queue.jobs[i].seconds;
+	}
+	fprintf(stderr, "%d files: %lld bytes, %.3f s, %.3f s on %d threads\n",
+		queue.njob, size, seconds, now() - start, n);
     }
 
-    time = 0;
-    for (i = 0; i < strlen(format); i++) {
-	double length;
-	int byte;
-
-	if (strpbrk(&format[i], "bhd")) {
-	    i = strpbrk(&format[i], "bhd") - format;
-	}else{
-	    break;
+    /* one summary per cache directory, which manifest lines may set */
+    for (i = 0; i < queue.njob; i++) {
+	if (queue.jobs[i].cachedir == NULL) {
+	    continue;
+	}
+	for (j = 0; j < i; j++) {
+	    if (queue.jobs[j].cachedir != NULL
+		&& strcmp(queue.jobs[j].cachedir, queue.jobs[i].cachedir) == 0)
+		break;
 	}
-	if (format[i] == 'd') {
-	    int sscanf_result = sscanf(&format[i + 1], "%d", &byte);
-	    if (sscanf_result == 0 || sscanf_result == EOF) {
-		byte = 0;
+	if (j < i) {
+	    continue;
+	}
+	for (j = i, hit = 0, miss = 0; j < queue.njob; j++) {
+	    if (queue.jobs[j].cachedir != NULL
+		&& strcmp(queue.jobs[j].cachedir, queue.jobs[i].cachedir) == 0) {
+		hit += queue.jobs[j].cachehit == 1;
+		miss += queue.jobs[j].cachehit == 0;
 	    }
-	}else{
-	    sscanf(&format[i + 1], "%lf", &length);
 	}
+	cache_report(&queue.jobs[i], hit, miss);
+    }
+    return 0;
+}
 
-	switch (format[i]) {
-	  case 'b':
-//	    if (size != 0) {
-//		size += header(0.05, fp_out);
-//	    }
-	    if (!cmtfile)
-		size += blank(length, fp_out);
-	    break;
-	  case 'h':
-	    if (!cmtfile)
-		size += header(length, fp_out);
-	    break;
-	  case 'd':
-	    for (j = 0; byte == 0 || j < byte; j++) {
-		if (intelhex)
-		    c = getihex();
-		else
-		    c = fgetc(fp_in);
-		if (c == EOF) {
-		    break;
-		}
-		if (cmtfile)
-		    fputc(c, fp_out);
-		else
-		    size += dataout(c, fp_out);
-	    }
-	    break;
-	  default:
+
+/* queue a conversion of input to output with the given parameters */
+void addjob(struct queue *queue, struct tape *param, char *input, char *output)
+{
+    struct tape *t;
+
+    queue->jobs = realloc(queue->jobs, (queue->njob + 1) * sizeof(struct tape));
+    if (queue->jobs == NULL) {
+	printf("cannot allocate memory\n");
+	exit(1);
+    }
+    t = &queue->jobs[queue->njob++];
+    *t = *param;
+    t->input = strdup(input);
+    t->output = strdup(output);
+    t->format = strdup(param->format);
+    if (param->cachedir != NULL) {
+	t->cachedir = strdup(param->cachedir);
+    }
+    if (t->input == NULL || t->output == NULL || t->format == NULL
+	|| (param->cachedir != NULL && t->cachedir == NULL)) {
+	printf("cannot allocate memory\n");
+	exit(1);
+    }
+    format_compile(t);
+
+    /* samples wider than 16 bits have no drift-exact cache; see wave.c */
+    if (t->quantization_bit > 16) {
+	t->dds = 1;
+    }
+}
+
+
+/*
+ * Jobs are taken from the shared queue one at a time, so a large image
+ * keeps one thread busy while the others go on with the small ones.
+ */
+void *work(void *arg)
+{
+    int i;
+    struct worker *w = arg;
+    struct queue *queue = w->queue;
+    struct tape *t;
+
+    for (;;) {
+	pthread_mutex_lock(&queue->lock);
+	i = queue->next++;
+	pthread_mutex_unlock(&queue->lock);
+	if (i >= queue->njob) {
 	    break;
 	}
-    }
-    if (!cmtfile)
-	wav_head(size, fp_out);
 
-//    fclose(fp_in);
-    fclose(fp_out);
-    return 0;
+	t = &queue->jobs[i];
+	t->ihex = &w->ihex;
+	t->out = &w->out;
+	t->caches = &w->caches;
+	convert(t);
+    }
+    return NULL;
 }
 
 
-void wav_head(int size, FILE *fp) {
-    rewind(fp);
+/* convert one input file */
+void convert(struct tape *t)
+{
+    int i;
+    long long size;
+    double seconds, start = now();
+    double wall = start, cpu = cputime(), written;
+    FILE *fp_out;
+
+    t->out->nwrite = 0;
+    t->out->nbyte = 0;
+    t->out->wall = 0;
+    t->out->cpu = 0;
+    t->out->wait = 0;
+    t->nalloc = 0;
+    t->nbit = 0;
+    memset(t->wall, 0, sizeof(t->wall));
+    memset(t->cpu, 0, sizeof(t->cpu));
 
-    /* RIFF identifier */
-    fputs("RIFF", fp);
+    /* input file */
+
+    input_open(&t->in, t->input);
+    t->nread = t->in.size;
+    stats_stage(t, STAGE_INPUT, &wall, &cpu);
+    if (t->intelhex)
+	readihex(t->ihex, (char *)t->in.data, t->in.size);
+    stats_stage(t, STAGE_PARSE, &wall, &cpu);
+    if (t->verbose) {
+	fprintf(stderr, "input: %lu bytes %s, %.3f s, %.1f MB/s\n",
+		(unsigned long)t->in.size, t->in.mapped ? "mapped" : "read",
+		now() - start, t->in.size / (now() - start) / 1e6);
+    }
+    if (t->verify) {
+	verify(t);
+	input_close(&t->in);
+	t->seconds = now() - start;
+	return;
+    }
+    if (t->intelhex)
+	input_close(&t->in);
+
+    /* a repeated conversion is taken from the cache */
 
-    /* file size */
-    fput4(size + 36, fp);
+    if (t->cachedir != NULL && cache_fetch(t)) {
+	if (t->verbose) {
+	    fprintf(stderr, "cache: hit %s\n", t->cachekey);
+	}
+	input_close(&t->in);
+	t->seconds = now() - start;
+	if (t->stats)
+	    stats_print(t);
+	return;
+    }
+
+    /* a counting pass gives the exact size before anything is written */
+
+    size = generate(t, NULL);
+    t->size = t->cmtfile ? size : size + wav_head_size(t);
+    stats_stage(t, STAGE_COUNT, &wall, &cpu);
+    if (!t->cmtfile && t->size - 8 > 0xffffffffLL) {
+	printf("%s: %lld bytes, too large for a wav file\n", t->output, t->size);
+	exit(1);
+    }
+    if (t->dryrun) {
+	for (i = 0, seconds = 0; i < t->nsection; i++) {
+	    seconds += t->program[i].seconds;
+	}
+	if (!t->cmtfile) {
+	    seconds = (double)size / t->sampling_rate
+		/ (t->nchannel * t->quantization_bit / 8);
+	}
+	printf("%s: %lld bytes, %.6f s\n", t->output, t->size, seconds);
+	input_close(&t->in);
+	t->seconds = now() - start;
+	if (t->stats)
+	    stats_print(t);
+	return;
+    }
+    t->nbit = 0;
 
-    /* WAVE identifier */
-    fputs("WAVE", fp);
+    /* output file */
 
-    /* fmt chunk start */
-    fputs("fmt ", fp);
+    if (strcmp(t->output, "-") == 0) {
+	fp_out = stdout;
+    }else{
+	fp_out = fopen(t->output, "wb");  /* b for Windows */
+	if (fp_out == NULL) {
+	    printf("cannot open %s\n", t->output);
+	    exit(1);
+	}
+    }
+    if (fp_out != stdout)
+	preallocate(t, fp_out);
+    stats_stage(t, STAGE_WRITE, &wall, &cpu);
+
+    /*
+     * make wav data; the writer thread runs alongside, so synthesis is
+     * charged only the time it waited for it, and cmtout() its writes
+     */
+
+    written = t->wall[STAGE_WRITE];
+    seconds = t->cpu[STAGE_WRITE];
+    if (!t->cmtfile)
+	wav_head(t, size, fp_out);
+    if (generate(t, fp_out) != size) {
+	printf("internal error: size mismatch\n");
+	exit(1);
+    }
+    output_flush(t, fp_out);
+    stats_stage(t, STAGE_SYNTHESIS, &wall, &cpu);
+    t->wall[STAGE_SYNTHESIS] -= t->wall[STAGE_WRITE] - written + t->out->wait;
+    t->cpu[STAGE_SYNTHESIS] -= t->cpu[STAGE_WRITE] - seconds;
+    t->wall[STAGE_WRITE] += t->out->wall;
+    t->cpu[STAGE_WRITE] += t->out->cpu;
+
+    if (t->verbose) {
+	fprintf(stderr, "total: %lld bytes, %ld writes, %ld allocations\n",
+		t->out->nbyte, t->out->nwrite, t->nalloc);
+    }
 
-    /* fmt chunk size */
-    fput4(16, fp);
+    if (fp_out != stdout)
+	fclose(fp_out);
+    input_close(&t->in);
+    if (t->cachedir != NULL)
+	cache_store(t);
+    stats_stage(t, STAGE_WRITE, &wall, &cpu);
 
-    /* format ID */
-    fput2(1, fp);
+    t->seconds = now() - start;
+    if (t->stats)
+	stats_print(t);
+}
 
-    /* monoaural or streo */
-    fput2(nchannel, fp);
 
-    /* sampling rate */
-    fput4(sampling_rate, fp);
+/*
+ * The size of a regular output file is known before writing, so its
+ * blocks are reserved in one go.  Where fallocate is not supported the
+ * file is just extended; the writes then fill it in.  Only for a file
+ * convert() has just opened and truncated: on stdout the offset, an
+ * O_APPEND or a longer existing file belong to the caller.
+ */
+void preallocate(struct tape *t, FILE *fp)
+{
+    int fd = fileno(fp);
+    struct stat st;
 
-    /* data rate */
-    fput4(sampling_rate * nchannel * quantization_bit / 8, fp);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || t->size == 0) {
+	return;
+    }
+    if (posix_fallocate(fd, 0, t->size) != 0) {
+	if (ftruncate(fd, t->size) != 0) {
+	    return;
+	}
+    }
+}
 
-    /* block size */
-    fput2(nchannel * quantization_bit / 8, fp);
 
-    /* sampling bit */
-    fput2(quantization_bit, fp);
+/*
+ * Each manifest line is a list of options followed by an input and an
+ * output file.  The options apply on top of the command line ones for
+ * that line only, and a manifest cannot name another one.  Double
+ * quotes group words, blank lines and lines starting with # are skipped.
+ */
+void batch(struct queue *queue, struct tape *param)
+{
+    int n, line;
+    char buf[4096], *p;
+    char *args[MANIFEST_ARGS];
+    struct tape t;
+    FILE *fp;
+
+    fp = fopen(param->manifest, "r");
+    if (fp == NULL) {
+	printf("cannot open %s\n", param->manifest);
+	exit(1);
+    }
 
-    /* data chunk start */
-    fputs("data", fp);
+    for (line = 1; fgets(buf, sizeof(buf), fp) != NULL; line++) {
+	args[0] = param->manifest;
+	for (n = 1, p = buf; n < MANIFEST_ARGS; n++) {
+	    p += strspn(p, " \t\r\n");
+	    if (*p == '\0' || (n == 1 && *p == '#')) {
+		break;
+	    }
+	    if (*p == '"') {
+		args[n] = ++p;
+		p += strcspn(p, "\"");
+	    }else{
+		args[n] = p;
+		p += strcspn(p, " \t\r\n");
+	    }
+	    if (*p != '\0') {
+		*p++ = '\0';
+	    }
+	}
+	if (n == 1) {
+	    continue;
+	}
 
-    /* data size */
-    fput4(size, fp);
+	t = *param;
+	if (option(&t, n, args) != n - 2) {
+	    printf("%s:%d: expected [options] input-file output-file\n",
+		   param->manifest, line);
+	    exit(1);
+	}
+	if (t.manifest != param->manifest) {
+	    printf("%s:%d: -m in a manifest\n", param->manifest, line);
+	    exit(1);
+	}
+	addjob(queue, &t, args[n - 2], args[n - 1]);
+    }
+    fclose(fp);
 }
 
 
-int option(int argc, char *argv[])
+int option(struct tape *t, int argc, char *argv[])
 {
     int i;
 
@@ -236,8 +468,8 @@ int option(int argc, char *argv[])
 	    if (++i >= argc) {
 		break;
 	    }
-	    baud_rate = atoi(argv[i]);
-	    if (baud_rate <= 0) {
+	    t->baud_rate = atoi(argv[i]);
+	    if (t->baud_rate <= 0) {
 		printf("illegal baud rate\n");
 		exit(1);
 	    }
@@ -247,8 +479,8 @@ int option(int argc, char *argv[])
 	    if (++i >= argc) {
 		break;
 	    }
-	    nchannel = atoi(argv[i]);
-	    if (nchannel != 1 && nchannel != 2) {
+	    t->nchannel = atoi(argv[i]);
+	    if (t->nchannel != 1 && t->nchannel != 2) {
 		printf("the number of channels must be 1 or 2\n");
 		exit(1);
 	    }
@@ -259,21 +491,21 @@ int option(int argc, char *argv[])
 		break;
 	    }
 	    if (strcmp(argv[i], "io") == 0) {
-		format = malloc(strlen(FORMAT_IO) + 1);
-		if (format == NULL) {
+		t->format = malloc(strlen(FORMAT_IO) + 1);
+		if (t->format == NULL) {
 		    printf("cannot allocate memory\n");
 		    exit(1);
 		}
-		strcpy(format, FORMAT_IO);
+		strcpy(t->format, FORMAT_IO);
 	    } else if (strcmp(argv[i], "bin") == 0) {
-		format = malloc(strlen(FORMAT_BIN) + 1);
-		if (format == NULL) {
+		t->format = malloc(strlen(FORMAT_BIN) + 1);
+		if (t->format == NULL) {
 		    printf("cannot allocate memory\n");
 		    exit(1);
 		}
-		strcpy(format, FORMAT_BIN);
+		strcpy(t->format, FORMAT_BIN);
 	    }else{
-		format = argv[i];
+		t->format = argv[i];
 	    }
 	}
 
@@ -281,9 +513,10 @@ int option(int argc, char *argv[])
 	    if (++i >= argc) {
 		break;
 	    }
-	    quantization_bit = atoi(argv[i]);
-	    if (quantization_bit != 8 && quantization_bit != 16) {
-		printf("sampling bit must be 8 or 16\n");
+	    t->quantization_bit = atoi(argv[i]);
+	    if (t->quantization_bit != 8 && t->quantization_bit != 16
+		&& t->quantization_bit != 24 && t->quantization_bit != 32) {
+		printf("sampling bit must be 8, 16, 24 or 32 (float)\n");
 		exit(1);
 	    }
 	}
@@ -292,8 +525,8 @@ int option(int argc, char *argv[])
 	    if (++i >= argc) {
 		break;
 	    }
-	    sampling_rate = atoi(argv[i]);
-	    if (sampling_rate < 1) {
+	    t->sampling_rate = atoi(argv[i]);
+	    if (t->sampling_rate < 1) {
 		printf("illegal sampling rate\n");
 		exit(1);
 	    }
@@ -303,8 +536,8 @@ int option(int argc, char *argv[])
 	    if (++i >= argc) {
 		break;
 	    }
-	    stop_bit = atoi(argv[i]);
-	    if (stop_bit < 0) {
+	    t->stop_bit = atoi(argv[i]);
+	    if (t->stop_bit < 0) {
 		printf("illegal stop bit\n");
 		exit(1);
 	    }
@@ -314,145 +547,93 @@ int option(int argc, char *argv[])
 	    if (++i >= argc) {
 		break;
 	    }
-	    carrier_low = atoi(argv[i]);
-	    if (carrier_low < 1) {
+	    t->carrier_low = atoi(argv[i]);
+	    if (t->carrier_low < 1) {
 		printf("illegal carrier frequency\n");
 		exit(1);
 	    }
 	}
 
+	if (strcmp(argv[i], "-j") == 0) {
+	    if (++i >= argc) {
+		break;
+	    }
+	    t->nthread = atoi(argv[i]);
+	    if (t->nthread < 1) {
+		printf("illegal number of threads\n");
+		exit(1);
+	    }
+	}
+
+	if (strcmp(argv[i], "-m") == 0) {
+	    if (++i >= argc) {
+		break;
+	    }
+	    t->manifest = argv[i];
+	}
+
 	if (strcmp(argv[i], "-i") == 0) {
-             intelhex = 1;
+             t->intelhex = 1;
         }
 
 	if (strcmp(argv[i], "-C") == 0) {
-             cmtfile = 1;
+             t->cmtfile = 1;
         }
-    }
 
-    if (format == NULL) {
-	format = malloc(strlen(FORMAT_DEFAULT) + 1);
-	if (format == NULL) {
-	    printf("cannot allocate memory\n");
-	    exit(1);
+	if (strcmp(argv[i], "-D") == 0) {
+	    t->dds = 1;
 	}
-	strcpy(format, FORMAT_DEFAULT);
-    }
 
-    if (carrier_low / baud_rate * baud_rate != carrier_low) {
-	printf("illegal carrier frequency\n");
-	exit(1);
-    }
-    if (sampling_rate < carrier_low * 8) {
-	printf("too low sampling rate\n");
-	exit(1);
-    }
-
-
-    return i;
-}
+	if (strcmp(argv[i], "-v") == 0) {
+	    t->verbose = 1;
+	}
 
+	if (strcmp(argv[i], "-V") == 0) {
+	    t->verify = 1;
+	}
 
-int dataout(char data, FILE *fp)
-{
-    int i, size;
+	if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--dry-run") == 0) {
+	    t->dryrun = 1;
+	}
 
-    /* start bit  */
-    size = fsk(carrier_low, fp);
+	if (strncmp(argv[i], "--cache=", 8) == 0) {
+	    t->cachedir = &argv[i][8];
+	}
 
-    /* data */
-    for (i = 0; i < 8; i++) {
-	if (data & (1 << i)) {
-	    size += fsk(carrier_low * 2, fp);
-	}else{
-	    size += fsk(carrier_low, fp);
+	if (strncmp(argv[i], "--cache-size=", 13) == 0) {
+	    t->cachesize = atoll(&argv[i][13]) * 1024 * 1024;
+	    if (t->cachesize <= 0) {
+		printf("illegal cache size\n");
+		exit(1);
+	    }
 	}
-    }
 
-    /* stop bit  */
-    for (i = 0; i < stop_bit; i++) {
-	size += fsk(carrier_low * 2, fp);
+	if (strcmp(argv[i], "--stats") == 0) {
+	    t->stats = 1;
+	}else if (strcmp(argv[i], "--stats=json") == 0) {
+	    t->stats = 2;
+	}
     }
 
-    return size;
-}
-
-
-int header(double length, FILE *fp)
-{
-    int size = 0;
-    double start = (int)(time * carrier_low) / (double)carrier_low;
-    while (time < start + length) {
-	size += fsk(carrier_low * 2, fp);
+    if (t->format == NULL) {
+	t->format = malloc(strlen(FORMAT_DEFAULT) + 1);
+	if (t->format == NULL) {
+	    printf("cannot allocate memory\n");
+	    exit(1);
+	}
+	strcpy(t->format, FORMAT_DEFAULT);
     }
-    return size;
-}
 
-
-int fsk(double freq, FILE *fp)
-{
-    int i, j;
-    int size;
-    double start = (int)(time * carrier_low) / (double)carrier_low;
-    char *data;
-
-    data = malloc ((sampling_rate / baud_rate + 2) * nchannel * quantization_bit / 8);
-    if (data == NULL) {
-	printf("cannot allocate memory\n");
+    if (t->carrier_low / t->baud_rate * t->baud_rate != t->carrier_low) {
+	printf("illegal carrier frequency\n");
 	exit(1);
     }
-
-    for (i = 0; time < start + 1. / baud_rate; i++, time += 1. / sampling_rate) {
-	for (j = 0; j < nchannel; j++) {
-	    if (quantization_bit == 8) {
-//		fputc(128 - 127 * sin(2 * M_PI * freq * (time - start)), fp);
-		data[i * nchannel + j]
-		    = 128 - 127 * sin(2 * M_PI * freq * (time - start));
-
-	    }else{
-//		fput2(-32767 * sin(2 * M_PI * freq * (time - start)), fp);
-		data[(i * nchannel + j) * 2]
-		    =  (int)(-32767 * sin(2 * M_PI * freq * (time - start))) & 0xff;
-		data[(i * nchannel + j) * 2 + 1]
-		    =  ((int)(-32767 * sin(2 * M_PI * freq * (time - start))) >> 8) & 0xff;
-	    }
-	}
-    }
-    size = i * j * quantization_bit / 8;
-    fwrite(data, 1, size, fp);
-    free(data);
-    return size;
-}
-
-
-int blank(double length, FILE *fp)
-{
-    int i, j;
-    for (i = 0; i < length * sampling_rate; i++) {
-	for (j = 0; j < nchannel; j++) {
-	    if (quantization_bit == 8) {
-		fputc(128, fp);
-	    }else{
-		fput2(0, fp);
-	    }
-	}
+    if (t->sampling_rate < t->carrier_low * 8) {
+	printf("too low sampling rate\n");
+	exit(1);
     }
-    time += (int) (length * sampling_rate) / sampling_rate;
-    return i * j * quantization_bit / 8;
-}
 
 
-void fput2(int data, FILE *fp)
-{
-    fputc(data & 0xff, fp);
-    fputc((data >> 8) & 0xff, fp);
+    return i;
 }
 
-
-void fput4(int data, FILE *fp)
-{
-    fputc(data & 0xff, fp);
-    fputc((data >> 8) & 0xff, fp);
-    fputc((data >> 16) & 0xff, fp);
-    fputc((data >> 24) & 0xff, fp);
-}
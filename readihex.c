@@ -11,42 +11,47 @@
 #include <unistd.h>
 #include <string.h>
 #include "intel_hex.h"
+#include "ihex2monl.h"
 
-struct intel_hex_record r;
-
-FILE *ihexfp;
-
-int size = 0;
-int start;
-unsigned char mem[1024*32];
-
-char my_slurp_char(void) {
-	return getc(ihexfp);
-}
+static void addihex(struct ihex *, unsigned long, const uint8_t *, int);
 
 //int main(int argc, char *argv[]) {
-int readihex(FILE *fp){
-	int offset;
+void readihex(struct ihex *h, const char *text, size_t length){
+	int i;
+	unsigned long base = 0;
 	enum intel_hex_slurp_error err;
+	struct intel_hex_record r;
+	struct intel_hex_parser p;
+	intel_hex_parser_init_buffer(&p, text, length);
 
-	ihexfp = fp;
+	/* Keep the extent table of the previous job, but not its data. */
+	for (i = 0; i < h->nextent; i++) {
+		free(h->extent[i].data);
+	}
+	h->nextent = 0;
+	memset(h->nrecord, 0, sizeof(h->nrecord));
+	h->payload = 0;
 
 	do {
-		err = slurp_next_intel_hex_record(&my_slurp_char, &r);
+		err = intel_hex_parse_record(&p, &r);
 
 		if (SLURP_ERROR_NONE != err) {
 			printf("Got error 0x%02X, aborting due to invalid record!", err);
 			exit(1);
 		}
+		if (r.record_type < 6)
+			h->nrecord[r.record_type]++;
 
 		switch (r.record_type) {
 			case DATA_RECORD:
-				if (size == 0) {
-					start = r.address;
-				}
-				offset = r.address - start;
-				size = offset + r.byte_count;
-				memcpy(mem + offset, r.data, r.byte_count);
+				h->payload += r.byte_count;
+				addihex(h, base + r.address, r.data, r.byte_count);
+				break;
+			case ESA_RECORD:
+				base = (unsigned long) (r.data[0] << 8 | r.data[1]) << 4;
+				break;
+			case ELA_RECORD:
+				base = (unsigned long) (r.data[0] << 8 | r.data[1]) << 16;
 				
 //				printf("Got data record with length %u\n", r.byte_count);
 				break;
@@ -54,15 +59,9 @@ int readihex(FILE *fp){
 			case EOF_RECORD:
 				puts("Got EOF record");
 				break;
-			case ESA_RECORD:
-				puts("Got ESA record");
-				break;
 			case SSA_RECORD:
 				puts("Got SSA record");
 				break;
-			case ELA_RECORD:
-				puts("Got ELA record");
-				break;
 			case SLA_RECORD:
 				puts("Got SLA record");
 				break;
@@ -70,75 +69,182 @@ int readihex(FILE *fp){
 		}
 	} while (r.record_type != EOF_RECORD);
 
-	printf("Start: %04x Size: %d\n", start, size);
+	if (h->nextent == 0) {
+		h->start = 0;
+		h->size = 0;
+	} else {
+		h->start = h->extent[0].address;
+		h->size = h->extent[h->nextent - 1].address
+			+ h->extent[h->nextent - 1].size - h->start;
+	}
+	encodeihex(h);
 
-	return EXIT_SUCCESS;
+	fprintf(stderr, "Start: %04lx Size: %ld\n", h->start, h->size);
+	if (h->nextent > 1) {
+		for (i = 0; i < h->nextent; i++) {
+			fprintf(stderr, "  %08lx-%08lx\n", h->extent[i].address,
+				h->extent[i].address + h->extent[i].size - 1);
+		}
+	}
 }
 
-int pos = 0;
-int dpos;
-int sam;
-int block;
-int bsize;
-int getihex()
+/* Adds one data record to the sorted extent table. Records that continue
+ * an extent are appended to it, and an extent that reaches the next one is
+ * merged with it, so the table only grows at gaps in the image. */
+static void addihex(struct ihex *h, unsigned long address, const uint8_t *data, int count)
 {
-unsigned char b;
-
-	if (pos == 0)
-		b = 0x3a;
-	else if (pos == 1)
-		b = start >> 8;
-	else if (pos == 2)
-		b = start & 0xff;
-	else if (pos == 3) {
-		b = start >> 8;
-		b += start & 0xff;
-		b = 0x100 - b;
-		block = 0;
-		dpos = 0;
-		sam = 0;
-	}
-	else if (pos == 4) {
-		if(dpos == 0) {
-			b = 0x3a;
-		}
-		else if (dpos == 1) {
-			if (size < (block + 1) * 256)
-				b = size - block * 255;
+	int lo, hi, mid;
+	struct extent *e, *next;
+
+	if (count == 0)
+		return;
+
+	/* Find the first extent starting above the address; records usually
+	 * come in order, so try the end of the table first. */
+	if (h->nextent == 0 || h->extent[h->nextent - 1].address < address) {
+		lo = h->nextent;
+	} else {
+		for (lo = 0, hi = h->nextent; lo < hi; ) {
+			mid = (lo + hi) / 2;
+			if (h->extent[mid].address <= address)
+				lo = mid + 1;
 			else
-				b = 255;
-			bsize = b;
-			sam += b;
+				hi = mid;
 		}
-		else if (dpos == bsize + 2) {
-			b = 0x100 - sam;
-
-			if (block * 255 + bsize == size)
-				pos = 5;
-			else {
-				++block;
-				dpos = -1;
-				sam = 0;
+	}
+
+	if ((lo > 0 && h->extent[lo - 1].address + h->extent[lo - 1].size > address)
+	    || (lo < h->nextent && address + count > h->extent[lo].address)) {
+		printf("Overlapping data at %08lx, aborting!\n", address);
+		exit(1);
+	}
+
+	if (lo > 0 && h->extent[lo - 1].address + h->extent[lo - 1].size == address) {
+		e = &h->extent[lo - 1];
+	} else {
+		if (h->nextent == h->allocated) {
+			h->allocated = h->allocated ? h->allocated * 2 : 16;
+			h->extent = realloc(h->extent, h->allocated * sizeof(struct extent));
+			if (h->extent == NULL) {
+				printf("cannot allocate memory\n");
+				exit(1);
 			}
 		}
-		else {
-			b = mem[block * 255 + dpos - 2];
-			sam += b;
+		memmove(&h->extent[lo + 1], &h->extent[lo],
+			(h->nextent - lo) * sizeof(struct extent));
+		h->nextent++;
+		e = &h->extent[lo];
+		e->address = address;
+		e->size = 0;
+		e->allocated = 0;
+		e->data = NULL;
+		lo++;
+	}
+
+	/* lo is now the extent after e */
+	next = lo < h->nextent && address + count == h->extent[lo].address
+		? &h->extent[lo] : NULL;
+	if (e->size + count + (next ? next->size : 0) > e->allocated) {
+		e->allocated = e->allocated ? e->allocated * 2 : 256;
+		while (e->allocated < e->size + count + (next ? next->size : 0))
+			e->allocated *= 2;
+		e->data = realloc(e->data, e->allocated);
+		if (e->data == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+	}
+	memcpy(e->data + e->size, data, count);
+	e->size += count;
+	if (next != NULL) {
+		memcpy(e->data + e->size, next->data, next->size);
+		e->size += next->size;
+		free(next->data);
+		memmove(next, next + 1, (h->nextent - lo - 1) * sizeof(struct extent));
+		h->nextent--;
+	}
+}
+
+/* Encodes the image as a mon tape: for each extent an address header
+ * (':', address, checksum), blocks of up to 255 bytes (':', length, data,
+ * checksum) and an end mark (':', 0, 0). Only the framing bytes are
+ * written; the stream is a list of iovecs alternating between runs of
+ * framing and block data inside the extents, so payload bytes are never
+ * copied. The sizes are known from the extents, so both arrays are
+ * allocated before any pointer into them is taken. The address header
+ * has 16 bits, so data above 64K cannot be loaded and is refused. */
+void encodeihex(struct ihex *h)
+{
+	int i, j, n, niov;
+	unsigned char *f, sum;
+	size_t k, nframe, size;
+	unsigned long start;
+	struct extent *e;
+	struct iovec *v;
+
+	nframe = 0;
+	size = 0;
+	niov = 1;
+	for (i = 0; i < h->nextent; i++) {
+		if (h->extent[i].address + h->extent[i].size > 0x10000) {
+			printf("Data at %08lx-%08lx is beyond 64K, aborting!\n",
+			       h->extent[i].address, h->extent[i].address
+			       + (unsigned long) h->extent[i].size - 1);
+			exit(1);
+		}
+		size += h->extent[i].size;
+		k = (h->extent[i].size + 254) / 255;
+		nframe += 4 + 3 * k + 3;
+		niov += 2 * k;
+	}
+	if (nframe > h->frameallocated) {
+		free(h->frame);
+		h->frame = malloc(nframe);
+		h->frameallocated = nframe;
+	}
+	if (niov > h->iovallocated) {
+		free(h->iov);
+		h->iov = malloc(niov * sizeof(struct iovec));
+		h->iovallocated = niov;
+	}
+	if ((nframe > 0 && h->frame == NULL) || h->iov == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	f = h->frame;
+	h->niov = 0;
+	h->nblock = 0;
+	h->iov[0].iov_base = f;
+	for (i = 0; i < h->nextent; i++) {
+		e = &h->extent[i];
+		start = e->address;
+		*f++ = 0x3a;
+		*f++ = start >> 8;
+		*f++ = start & 0xff;
+		*f++ = 0x100 - ((start >> 8) + start);
+		for (k = 0; k < e->size; k += n) {
+			n = e->size - k < 255 ? e->size - k : 255;
+			*f++ = 0x3a;
+			*f++ = n;
+			for (sum = n, j = 0; j < n; j++)
+				sum += e->data[k + j];
+
+			/* close the run of framing, then point at the data */
+			v = &h->iov[h->niov];
+			v[0].iov_len = f - (unsigned char *) v[0].iov_base;
+			v[1].iov_base = e->data + k;
+			v[1].iov_len = n;
+			v[2].iov_base = f;
+			h->niov += 2;
+			h->nblock++;
+			*f++ = 0x100 - sum;
 		}
-		
-		++dpos;
+		*f++ = 0x3a;
+		*f++ = 0x00;
+		*f++ = 0x00;
 	}
-	// pos 5 is end of blcok
-	else if (pos == 6)
-		b = 0x3a;
-	else if (pos == 7)
-		b = 0x00;
-	else if (pos == 8)
-		b = 0x00;
-	else
-		 return -1;
-	
-	if (pos != 4) ++pos;
-//printf("%02x ", b);
-	return b;
+	v = &h->iov[h->niov++];
+	v->iov_len = f - (unsigned char *) v->iov_base;
+	h->monsize = nframe + size;
 }
@@ -0,0 +1,142 @@
+/*
+  stats.c : counters and stage timing of one job, printed with --stats
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "ihex2monl.h"
+
+static void json_string(const char *);
+
+static char *stage_name[NSTAGE] = {
+    "input", "parse", "count", "synthesis", "write"
+};
+
+static char *record_name[6] = {
+    "data", "eof", "esa", "ssa", "ela", "sla"
+};
+
+
+/* wall clock in seconds */
+double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+/* CPU time of the calling thread in seconds */
+double cputime(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+	return 0;
+    }
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Charges the time since *wall and *cpu to a stage and restarts them
+ * from now, so consecutive calls split a job into its stages.
+ */
+void stats_stage(struct tape *t, enum stage stage, double *wall, double *cpu)
+{
+    double w = now(), c = cputime();
+
+    t->wall[stage] += w - *wall;
+    t->cpu[stage] += c - *cpu;
+    *wall = w;
+    *cpu = c;
+}
+
+
+/*
+ * Prints the counters of a finished job to stderr, as text or as one
+ * JSON object per line.  Jobs of a batch finish on several threads, so
+ * stderr is locked for the whole report.
+ */
+void stats_print(struct tape *t)
+{
+    int i;
+    int bytes = t->nchannel * t->quantization_bit / 8;
+    long long nsample;
+    struct ihex *h = t->ihex;
+    static const struct ihex none;
+
+    if (!t->intelhex) {
+	h = (struct ihex *)&none;
+    }
+    nsample = t->cmtfile ? 0 : (t->size - wav_head_size(t)) / bytes;
+
+    flockfile(stderr);
+    if (t->stats == 1) {
+	fprintf(stderr, "stats: %s -> %s\n", t->input, t->output);
+	fprintf(stderr, "  records:");
+	for (i = 0; i < 6; i++) {
+	    fprintf(stderr, " %s %ld%s", record_name[i], h->nrecord[i],
+		    i < 5 ? "," : "\n");
+	}
+	fprintf(stderr, "  input: %lld bytes, %lld payload bytes, "
+		"%lu mon bytes in %ld blocks\n",
+		t->nread, h->payload,
+		(unsigned long)h->monsize, h->nblock);
+	fprintf(stderr, "  tape: %lld bits, %lld samples\n", t->nbit, nsample);
+	fprintf(stderr, "  output: %lld bytes in %ld writes, %ld allocations\n",
+		t->out->nbyte, t->out->nwrite, t->nalloc);
+	if (t->cachehit >= 0) {
+	    fprintf(stderr, "  cache: %s %s\n",
+		    t->cachehit ? "hit" : "miss", t->cachekey);
+	}
+	for (i = 0; i < NSTAGE; i++) {
+	    fprintf(stderr, "  %-9s %9.6f s wall %9.6f s cpu\n",
+		    stage_name[i], t->wall[i], t->cpu[i]);
+	}
+    }else{
+	fprintf(stderr, "{\"input\":");
+	json_string(t->input);
+	fprintf(stderr, ",\"output\":");
+	json_string(t->output);
+	fprintf(stderr, ",\"records\":{");
+	for (i = 0; i < 6; i++) {
+	    fprintf(stderr, "%s\"%s\":%ld", i ? "," : "",
+		    record_name[i], h->nrecord[i]);
+	}
+	fprintf(stderr, "},\"input_bytes\":%lld,\"payload_bytes\":%lld,"
+		"\"mon_bytes\":%lu,\"mon_blocks\":%ld,\"bits\":%lld,"
+		"\"samples\":%lld,\"bytes_written\":%lld,\"write_calls\":%ld,"
+		"\"allocations\":%ld,\"stages\":{",
+		t->nread, h->payload,
+		(unsigned long)h->monsize, h->nblock, t->nbit, nsample,
+		t->out->nbyte, t->out->nwrite, t->nalloc);
+	for (i = 0; i < NSTAGE; i++) {
+	    fprintf(stderr, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}",
+		    i ? "," : "", stage_name[i], t->wall[i], t->cpu[i]);
+	}
+	fprintf(stderr, "},\"cache\":%s}\n", t->cachehit < 0 ? "null"
+		: t->cachehit ? "\"hit\"" : "\"miss\"");
+    }
+    funlockfile(stderr);
+}
+
+
+/* s as a JSON string on stderr */
+static void json_string(const char *s)
+{
+    putc('"', stderr);
+    for (; *s != '\0'; s++) {
+	if (*s == '"' || *s == '\\') {
+	    fprintf(stderr, "\\%c", *s);
+	}else if ((unsigned char)*s < 0x20) {
+	    fprintf(stderr, "\\u%04x", (unsigned char)*s);
+	}else{
+	    putc(*s, stderr);
+	}
+    }
+    putc('"', stderr);
+}
@@ -0,0 +1,639 @@
+/*
+  tape.c : tape synthesis, from the compiled format to wav or cmt data
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <errno.h>
+#include <unistd.h>
+#include "ihex2monl.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TAPE_X86
+#endif
+
+#ifndef M_PI
+#define M_PI 3.141592653589793
+#endif
+
+#define CMT_IOV 64
+#define CMT_CHUNK (16 * INPUT_CHUNK)	/* bytes per writev() */
+
+int dataout(struct tape *, char, FILE *);
+long long header(struct tape *, double, FILE *);
+int fsk(struct tape *, double, FILE *);
+int fsk_bit(struct tape *, double, char *);
+static void zeroupper(void);
+long long blank(struct tape *, double, FILE *);
+void put2(char *, int);
+void put4(char *, unsigned long);
+void output_write(struct tape *, FILE *, size_t);
+void output_wait(struct output *);
+void *output_writer(void *);
+long long cmtout(struct tape *, struct iovec *, int, size_t, FILE *);
+
+
+/*
+ * Runs the compiled format over the whole input.  With a NULL fp nothing
+ * is rendered; time advances exactly as it would and the size of the
+ * wav data is returned.
+ */
+long long generate(struct tape *t, FILE *fp_out)
+{
+    int i, k, niov;
+    long long size = 0;
+    size_t j, n, pos, off, datasize;
+    double seconds;
+    struct iovec raw, *iov;
+
+    /* the mon byte stream, or the raw input */
+    if (t->intelhex) {
+	iov = t->ihex->iov;
+	niov = t->ihex->niov;
+	datasize = t->ihex->monsize;
+    }else{
+	raw.iov_base = t->in.data;
+	raw.iov_len = t->in.size;
+	iov = &raw;
+	niov = 1;
+	datasize = t->in.size;
+    }
+    pos = 0;
+    k = 0;
+    off = 0;
+    seconds = format_plan(t, datasize);
+    if (t->verbose && !t->cmtfile && fp_out != NULL) {
+	fprintf(stderr, "plan: %d sections, %.3f s\n", t->nsection, seconds);
+    }
+
+    t->time = 0;
+    t->tick = 0;
+    for (i = 0; i < t->nsection; i++) {
+	struct section *s = &t->program[i];
+	long long section = size;
+	long allocated = t->nalloc;
+
+	switch (s->type) {
+	  case 'b':
+//	    if (size != 0) {
+//		size += header(t, 0.05, fp_out);
+//	    }
+	    if (!t->cmtfile)
+		size += blank(t, s->length, fp_out);
+	    break;
+	  case 'h':
+	    if (!t->cmtfile)
+		size += header(t, s->length, fp_out);
+	    break;
+	  case 'd':
+	    n = s->count == 0 || s->count > datasize - pos ? datasize - pos : s->count;
+	    if (!t->cmtfile) {
+		for (j = 0; j < n; j++, off++) {
+		    while (off == iov[k].iov_len) {
+			k++;
+			off = 0;
+		    }
+		    size += dataout(t, ((unsigned char *)iov[k].iov_base)[off], fp_out);
+		    if (!t->intelhex && off % INPUT_CHUNK == 0)
+			input_release(&t->in, off);
+		}
+	    }
+	    pos += n;
+	    break;
+	  default:
+	    break;
+	}
+
+	if (t->verbose && !t->cmtfile && fp_out != NULL) {
+	    fprintf(stderr, "%c: %lld bytes, %.3f s planned, %ld allocations\n",
+		    s->type, size - section, s->seconds, t->nalloc - allocated);
+	}
+    }
+
+    /* a cmt file is just the bytes the 'd' sections took */
+    if (t->cmtfile)
+	size = fp_out != NULL ? cmtout(t, iov, niov, pos, fp_out) : pos;
+    return size;
+}
+
+
+/*
+ * Write the first n bytes of the stream with writev(), straight from
+ * the iovecs, so the image data is never copied or passed through stdio.
+ */
+long long cmtout(struct tape *t, struct iovec *iov, int niov, size_t n, FILE *fp)
+{
+    int i, j, k;
+    size_t off, left, step;
+    ssize_t written;
+    double wall = now(), cpu = cputime();
+    struct iovec v[CMT_IOV];
+
+    fflush(fp);
+    k = 0;
+    off = 0;
+    for (left = n; left > 0; left -= written) {
+	/* up to CMT_IOV pieces and CMT_CHUNK bytes from the cursor on */
+	for (i = 0, j = k, step = 0; i < CMT_IOV && j < niov && step < left
+		 && step < CMT_CHUNK; j++) {
+	    v[i].iov_base = (char *)iov[j].iov_base + (j == k ? off : 0);
+	    v[i].iov_len = iov[j].iov_len - (j == k ? off : 0);
+	    if (v[i].iov_len > left - step)
+		v[i].iov_len = left - step;
+	    if (v[i].iov_len > CMT_CHUNK - step)
+		v[i].iov_len = CMT_CHUNK - step;
+	    step += v[i].iov_len;
+	    if (v[i].iov_len > 0)
+		i++;
+	}
+	written = writev(fileno(fp), v, i);
+	if (written < 0 && errno == EINTR) {
+	    written = 0;
+	    continue;
+	}
+	if (written <= 0) {
+	    printf("cannot write %s\n", t->output);
+	    exit(1);
+	}
+	t->out->nwrite++;
+	t->out->nbyte += written;
+
+	/* move the cursor past what was written */
+	for (step = written; step > 0; step -= i) {
+	    i = iov[k].iov_len - off < step ? iov[k].iov_len - off : step;
+	    off += i;
+	    if (off == iov[k].iov_len) {
+		k++;
+		off = 0;
+	    }
+	}
+	if (!t->intelhex)
+	    input_release(&t->in, off);
+    }
+    stats_stage(t, STAGE_WRITE, &wall, &cpu);
+    return n;
+}
+
+
+/*
+ * 8 and 16-bit output keeps the plain 44 byte PCM header.  24-bit and
+ * float samples use WAVE_FORMAT_EXTENSIBLE, which adds the valid bits,
+ * the speaker mask and the sample format GUID to the fmt chunk.
+ */
+int wav_head_size(struct tape *t)
+{
+    return t->quantization_bit > 16 ? 68 : 44;
+}
+
+
+/* the header goes into the arena, so data writes stay chunk aligned */
+void wav_head(struct tape *t, long long size, FILE *fp) {
+    int head = wav_head_size(t);
+    char *p = output(t, head, fp);
+
+    /* RIFF identifier */
+    memcpy(&p[0], "RIFF", 4);
+
+    /* file size */
+    put4(&p[4], size + head - 8);
+
+    /* WAVE identifier */
+    memcpy(&p[8], "WAVE", 4);
+
+    /* fmt chunk start */
+    memcpy(&p[12], "fmt ", 4);
+
+    /* fmt chunk size */
+    put4(&p[16], head - 28);
+
+    /* format ID */
+    put2(&p[20], head == 44 ? 1 : 0xfffe);
+
+    /* monoaural or streo */
+    put2(&p[22], t->nchannel);
+
+    /* sampling rate */
+    put4(&p[24], t->sampling_rate);
+
+    /* data rate */
+    put4(&p[28], t->sampling_rate * t->nchannel * t->quantization_bit / 8);
+
+    /* block size */
+    put2(&p[32], t->nchannel * t->quantization_bit / 8);
+
+    /* sampling bit */
+    put2(&p[34], t->quantization_bit);
+
+    if (head > 44) {
+	/* extension size */
+	put2(&p[36], 22);
+
+	/* valid bits */
+	put2(&p[38], t->quantization_bit);
+
+	/* front center, or front left and right */
+	put4(&p[40], t->nchannel == 1 ? 0x4 : 0x3);
+
+	/* KSDATAFORMAT_SUBTYPE_PCM or _IEEE_FLOAT */
+	memcpy(&p[44], t->quantization_bit == 32
+	       ? "\x03\x00\x00\x00\x00\x00\x10\x00\x80\x00\x00\xaa\x00\x38\x9b\x71"
+	       : "\x01\x00\x00\x00\x00\x00\x10\x00\x80\x00\x00\xaa\x00\x38\x9b\x71", 16);
+    }
+
+    /* data chunk start */
+    memcpy(&p[head - 8], "data", 4);
+
+    /* data size */
+    put4(&p[head - 4], size);
+
+    t->out->length += head;
+}
+
+
+int dataout(struct tape *t, char data, FILE *fp)
+{
+    int i, size;
+
+    /* start bit  */
+    size = fsk(t, t->carrier_low, fp);
+
+    /* data */
+    for (i = 0; i < 8; i++) {
+	if (data & (1 << i)) {
+	    size += fsk(t, t->carrier_low * 2, fp);
+	}else{
+	    size += fsk(t, t->carrier_low, fp);
+	}
+    }
+
+    /* stop bit  */
+    for (i = 0; i < t->stop_bit; i++) {
+	size += fsk(t, t->carrier_low * 2, fp);
+    }
+
+    return size;
+}
+
+
+long long header(struct tape *t, double length, FILE *fp)
+{
+    int n, used, room;
+    long long size = 0;
+    int bit = (t->sampling_rate / t->baud_rate + 2) * t->nchannel * t->quantization_bit / 8;
+    double start = (int)(t->time * t->carrier_low) / (double)t->carrier_low;
+    char *data;
+
+    /* whole bits of leader tone are rendered straight into the arena */
+    room = bit > OUTPUT_CHUNK ? bit : OUTPUT_CHUNK;
+    while (t->time < start + length) {
+	if (fp == NULL) {
+	    size += fsk_bit(t, t->carrier_low * 2, NULL);
+	    continue;
+	}
+	data = output(t, room, fp);
+	for (used = 0; used + bit <= room && t->time < start + length; used += n) {
+	    n = fsk_bit(t, t->carrier_low * 2, &data[used]);
+	}
+	t->out->length += used;
+	size += used;
+    }
+    return size;
+}
+
+
+int fsk(struct tape *t, double freq, FILE *fp)
+{
+    int size;
+
+    if (fp == NULL) {
+	return fsk_bit(t, freq, NULL);
+    }
+    size = fsk_bit(t, freq,
+		   output(t, (t->sampling_rate / t->baud_rate + 2) * t->nchannel * t->quantization_bit / 8, fp));
+    t->out->length += size;
+    return size;
+}
+
+
+/*
+ * Render one bit into data, which has room for the longest bit.  A
+ * NULL data only advances time.
+ */
+/*
+ * libc's AVX string and math routines may return with the upper halves
+ * of the ymm registers dirty, and every SSE instruction of the sample
+ * loops then waits on them.  Clearing them once per bit costs a cycle.
+ */
+#ifdef TAPE_X86
+__attribute__((target("avx")))
+static void zeroupper_avx(void)
+{
+    _mm256_zeroupper();
+}
+#endif
+
+static void zeroupper(void)
+{
+#ifdef TAPE_X86
+    if (__builtin_cpu_supports("avx"))
+	zeroupper_avx();
+#endif
+}
+
+int fsk_bit(struct tape *t, double freq, char *data)
+{
+    int i, k, fresh = 0;
+    int bytes = t->nchannel * t->quantization_bit / 8;
+    double time = t->time;
+    double start = (int)(time * t->carrier_low) / (double)t->carrier_low;
+    double end = start + 1. / t->baud_rate, step = 1. / t->sampling_rate;
+    double v, r, slope, tolerance, drift;
+    struct wave_cell *cell;
+
+    /* time is stepped in a local, or every sample would store it */
+    t->nbit++;
+    zeroupper();
+    if (t->dds) {
+	return wave_dds_bit(t, freq, data);
+    }
+    if (data == NULL) {
+	for (i = 0; time < end; i++, time += step)
+	    ;
+	t->time = time;
+	return i * bytes;
+    }
+
+    /*
+     * Samples are taken from the cache unless the accumulated drift of
+     * time could change the rounded value, in which case the sample is
+     * recomputed exactly as before and the cache follows the drift.
+     * Sample i is off the cell by the drift of the first sample, the
+     * spread of the cell's offsets and at most one rounding of time per
+     * sample.  When that bound is within the margins of all but the
+     * cell's fragile samples, only those are checked.
+     */
+    cell = wave_cell(t, freq, time - start);
+    slope = 2 * M_PI * freq * (t->quantization_bit == 8 ? 127 : 32767);
+    tolerance = (t->quantization_bit == 8 ? 127 : 32767) * 1e-12;
+
+    i = 0;
+    if (cell != NULL) {
+	drift = fabs(time - start - cell->low) > fabs(time - start - cell->high)
+	    ? fabs(time - start - cell->low) : fabs(time - start - cell->high);
+	drift += (cell->nsample + 8) * DBL_EPSILON * (end + 1);
+	if (drift * slope + tolerance < cell->least) {
+	    for (k = 0; time < end && i < cell->nsample; i++, time += step) {
+		if (i != cell->fragile[k])
+		    continue;
+		k++;
+		if (fabs(time - start - cell->offset[i]) * slope + tolerance
+		    >= cell->margin[i]) {
+		    wave_sample(t, cell, i, freq, time - start);
+		    r = cell->offset[i] - i * step;
+		    if (r < cell->low)
+			cell->low = r;
+		    if (r > cell->high)
+			cell->high = r;
+		}
+	    }
+	}else{
+	    for (; time < end && i < cell->nsample; i++, time += step) {
+		if (fabs(time - start - cell->offset[i]) * slope + tolerance
+		    >= cell->margin[i]) {
+		    wave_sample(t, cell, i, freq, time - start);
+		    fresh = 1;
+		}
+	    }
+	    if (fresh)
+		wave_bound(t, cell);
+	}
+    }
+    for (; time < end; i++, time += step) {
+//	fputc(128 - 127 * sin(2 * M_PI * freq * (time - start)), fp);
+//	fput2(-32767 * sin(2 * M_PI * freq * (time - start)), fp);
+	v = t->quantization_bit == 8
+	    ? 128 - 127 * sin(2 * M_PI * freq * (time - start))
+	    : -32767 * sin(2 * M_PI * freq * (time - start));
+	wave_format(t, &v, 1, &data[i * bytes]);
+    }
+    t->time = time;
+    if (cell != NULL) {
+	memcpy(data, cell->data, (i < cell->nsample ? i : cell->nsample) * bytes);
+    }
+    return i * bytes;
+}
+
+
+long long blank(struct tape *t, double length, FILE *fp)
+{
+    long long n, size = 0;
+    int bytes = t->nchannel * t->quantization_bit / 8;
+    long long nsample = length > 0 ? ceil(length * t->sampling_rate) : 0;
+
+    /* silence is filled a chunk at a time */
+    while (size < nsample * bytes) {
+	n = nsample * bytes - size;
+	if (n > OUTPUT_CHUNK) {
+	    n = OUTPUT_CHUNK;
+	}
+	if (fp != NULL) {
+	    memset(output(t, n, fp), t->quantization_bit == 8 ? 128 : 0, n);
+	    t->out->length += n;
+	}
+	size += n;
+    }
+    if (t->dds) {
+	t->tick += nsample;
+	t->time = (double)t->tick / t->sampling_rate;
+    }else{
+	t->time += (long long) (length * t->sampling_rate) / t->sampling_rate;
+    }
+    return size;
+}
+
+
+void put2(char *p, int data)
+{
+    p[0] = data & 0xff;
+    p[1] = (data >> 8) & 0xff;
+}
+
+
+void put4(char *p, unsigned long data)
+{
+    p[0] = data & 0xff;
+    p[1] = (data >> 8) & 0xff;
+    p[2] = (data >> 16) & 0xff;
+    p[3] = (data >> 24) & 0xff;
+}
+
+
+/* counted malloc() for everything allocated while generating */
+void *alloc(struct tape *t, size_t size)
+{
+    void *p;
+
+    p = malloc(size);
+    if (p == NULL) {
+	printf("cannot allocate memory\n");
+	exit(1);
+    }
+    t->nalloc++;
+    return p;
+}
+
+
+/*
+ * Returns room for size bytes at the end of the output arena.  The
+ * caller adds what it actually used to out->length.  Full chunks are
+ * handed to the writer as the arena fills and the rest is kept, so
+ * every write but the last is OUTPUT_CHUNK aligned in the file.
+ */
+char *output(struct tape *t, size_t size, FILE *fp)
+{
+    char *data;
+    struct output *out = t->out;
+
+    if (out->length + size > out->size) {
+	output_write(t, fp, out->length / OUTPUT_CHUNK * OUTPUT_CHUNK);
+    }
+    if (out->length + size > out->size) {
+	data = alloc(t, out->length + size > 2 * OUTPUT_CHUNK
+		     ? out->length + size : 2 * OUTPUT_CHUNK);
+	memcpy(data, out->data, out->length);
+	free(out->data);
+	out->data = data;
+	out->size = out->length + size > 2 * OUTPUT_CHUNK
+	    ? out->length + size : 2 * OUTPUT_CHUNK;
+    }
+    return &out->data[out->length];
+}
+
+
+/* hand everything to the writer and wait until it is on disk */
+void output_flush(struct tape *t, FILE *fp)
+{
+    output_write(t, fp, t->out->length);
+    output_wait(t->out);
+}
+
+
+/*
+ * Hands the first n bytes of the arena to the writer thread and goes on
+ * in the other buffer, which starts with the rest.  The synthesis only
+ * stops when that buffer is still being written, so with two buffers
+ * the output never takes more memory however long the tape is.
+ */
+void output_write(struct tape *t, FILE *fp, size_t n)
+{
+    char *data;
+    size_t size;
+    struct output *out = t->out;
+
+    if (n == 0) {
+	return;
+    }
+    if (!out->started) {
+	pthread_mutex_init(&out->lock, NULL);
+	pthread_cond_init(&out->cond, NULL);
+	if (pthread_create(&out->thread, NULL, output_writer, out) != 0) {
+	    printf("cannot create thread\n");
+	    exit(1);
+	}
+	out->started = 1;
+    }
+
+    output_wait(out);
+    if (out->sparesize < out->size) {
+	free(out->spare);
+	out->spare = alloc(t, out->size);
+	out->sparesize = out->size;
+    }
+    memcpy(out->spare, &out->data[n], out->length - n);
+
+    pthread_mutex_lock(&out->lock);
+    out->pending = out->data;
+    out->npending = n;
+    out->fd = fileno(fp);
+    out->name = t->output;
+    pthread_cond_broadcast(&out->cond);
+    pthread_mutex_unlock(&out->lock);
+
+    data = out->data;
+    out->data = out->spare;
+    out->spare = data;
+    size = out->size;
+    out->size = out->sparesize;
+    out->sparesize = size;
+    out->length -= n;
+}
+
+
+/* until the writer is idle, so that the spare buffer is free */
+void output_wait(struct output *out)
+{
+    double start;
+
+    if (!out->started) {
+	return;
+    }
+    pthread_mutex_lock(&out->lock);
+    if (out->pending != NULL) {
+	start = now();
+	while (out->pending != NULL) {
+	    pthread_cond_wait(&out->cond, &out->lock);
+	}
+	out->wait += now() - start;
+    }
+    pthread_mutex_unlock(&out->lock);
+}
+
+
+/*
+ * The writer thread of a worker, for all of its jobs.  It owns the
+ * pending buffer until it sets it back to NULL.
+ */
+void *output_writer(void *arg)
+{
+    size_t done;
+    ssize_t written;
+    long nwrite;
+    double wall, cpu;
+    struct output *out = arg;
+
+    pthread_mutex_lock(&out->lock);
+    for (;;) {
+	while (out->pending == NULL) {
+	    pthread_cond_wait(&out->cond, &out->lock);
+	}
+	pthread_mutex_unlock(&out->lock);
+
+	wall = now();
+	cpu = cputime();
+	for (done = 0, nwrite = 0; done < out->npending; done += written) {
+	    written = write(out->fd, &out->pending[done], out->npending - done);
+	    if (written < 0 && errno == EINTR) {
+		written = 0;
+		continue;
+	    }
+	    if (written <= 0) {
+		printf("cannot write %s\n", out->name);
+		exit(1);
+	    }
+	    nwrite++;
+	}
+
+	pthread_mutex_lock(&out->lock);
+	out->nwrite += nwrite;
+	out->nbyte += out->npending;
+	out->wall += now() - wall;
+	out->cpu += cputime() - cpu;
+	out->pending = NULL;
+	pthread_cond_broadcast(&out->cond);
+    }
+    return NULL;
+}
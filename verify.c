@@ -0,0 +1,403 @@
+/*
+  verify.c : demodulates a generated wav file and checks it against the
+  source, with -V
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "ihex2monl.h"
+
+#define VERIFY_BLOCK 4096	/* samples converted at a time */
+
+/* data chunk of a wav file */
+struct wav {
+    unsigned char *data;
+    size_t nsample;
+    int sampling_rate;
+    int quantization_bit;	/* 32 is float */
+    int nchannel;
+};
+
+/* demodulator and decoder state */
+struct decoder {
+    /* zero crossings */
+    double last;	/* position of the last crossing, in samples */
+    double high;	/* half cycles shorter than this are the high carrier */
+    double gap;		/* longer than this is silence */
+    int sign;		/* of the last sample, 1 at or above the centre */
+
+    /* runs of half cycles of one carrier */
+    int carrier;	/* 0 low, 1 high, -1 none */
+    long run;
+    int halfcycles[2];	/* per bit of each carrier */
+
+    /* start-stop framing */
+    int stop_bit;
+    int bit;		/* -1 between bytes, then 0 to 8 + stop_bit */
+    int byte;
+    long nframe;	/* framing errors */
+
+    /* expected byte stream */
+    struct iovec *iov;
+    int niov;
+    int k;
+    size_t off;
+    long long pos;
+    long long length;
+    long long mismatch;	/* first wrong byte, or -1 */
+
+    /* mon blocks */
+    int intelhex;
+    int mon;		/* position within the mon stream, see mon() */
+    int left;
+    unsigned char sum;
+    long nblock;
+    long nsum;		/* checksum errors */
+};
+
+static void wav_open(struct wav *, struct input *, char *);
+static void wav_samples(struct wav *, size_t, int, float *);
+static void crossing(struct decoder *, double);
+static void run(struct decoder *);
+static void bit(struct decoder *, int);
+static void byte(struct decoder *, int);
+static void mon(struct decoder *, int);
+static int get2(unsigned char *);
+static long get4(unsigned char *);
+
+
+/*
+ * Reads the wav file named by the job's output and decodes it back to
+ * bytes: zero crossings give half cycles of the low or the high carrier,
+ * runs of them give bits, and the start-stop framing of dataout() gives
+ * bytes.  The bytes must be those the 'd' sections took from the input;
+ * for an Intel HEX input every mon block checksum is verified as well.
+ * The waveform is never rendered, so this runs far faster than real time.
+ */
+void verify(struct tape *t)
+{
+    int i, n;
+    size_t first, datasize;
+    double start = now(), seconds;
+    float v[VERIFY_BLOCK], prev;
+    struct input in;
+    struct wav w;
+    struct iovec raw;
+    struct decoder d;
+
+    memset(&d, 0, sizeof(d));
+    if (t->intelhex) {
+	d.iov = t->ihex->iov;
+	d.niov = t->ihex->niov;
+	datasize = t->ihex->monsize;
+    }else{
+	raw.iov_base = t->in.data;
+	raw.iov_len = t->in.size;
+	d.iov = &raw;
+	d.niov = 1;
+	datasize = t->in.size;
+    }
+    d.length = format_data(t, datasize);
+    d.mismatch = -1;
+    d.intelhex = t->intelhex;
+    d.stop_bit = t->stop_bit;
+    d.bit = -1;
+    d.carrier = -1;
+
+    input_open(&in, t->output);
+    if (t->cmtfile) {
+	/* a cmt file holds the bytes themselves */
+	for (first = 0; first < in.size; first++) {
+	    byte(&d, in.data[first]);
+	}
+	seconds = 0;
+    }else{
+	wav_open(&w, &in, t->output);
+	if (w.sampling_rate < t->carrier_low * 8) {
+	    printf("%s: too low sampling rate\n", t->output);
+	    exit(1);
+	}
+
+	/* a low half cycle is twice as long as a high one; split at 3/4 */
+	d.high = 0.375 * w.sampling_rate / t->carrier_low;
+	d.gap = 1.5 * w.sampling_rate / t->carrier_low;
+	d.halfcycles[0] = 2 * t->carrier_low / t->baud_rate;
+	d.halfcycles[1] = 4 * t->carrier_low / t->baud_rate;
+	d.last = -d.gap - 1;
+	d.sign = 1;
+
+	/* crossings are interpolated between the samples around them */
+	prev = 0;
+	for (first = 0; first < w.nsample; first += n) {
+	    n = w.nsample - first < VERIFY_BLOCK ? w.nsample - first : VERIFY_BLOCK;
+	    wav_samples(&w, first, n, v);
+	    for (i = 0; i < n; i++) {
+		if ((v[i] >= 0) != d.sign) {
+		    d.sign = !d.sign;
+		    crossing(&d, first + i - 1 + prev / (prev - v[i]));
+		}
+		prev = v[i];
+	    }
+	}
+	crossing(&d, w.nsample + d.gap + 1);
+	seconds = (double)w.nsample / w.sampling_rate;
+    }
+    input_close(&in);
+
+    if (d.mismatch >= 0 || d.pos != d.length || d.nframe || d.nsum) {
+	printf("%s: verify failed: %lld of %lld bytes", t->output,
+	       d.pos, d.length);
+	if (d.mismatch >= 0)
+	    printf(", first difference at byte %lld", d.mismatch);
+	printf(", %ld framing errors, %ld checksum errors\n",
+	       d.nframe, d.nsum);
+	exit(1);
+    }
+    printf("%s: %lld bytes", t->output, d.pos);
+    if (t->intelhex)
+	printf(", %ld blocks", d.nblock);
+    printf(" verified");
+    if (!t->cmtfile)
+	printf(", %.3f s of tape", seconds);
+    printf(" in %.3f s\n", now() - start);
+}
+
+
+/* finds the fmt and data chunks of a wav file */
+static void wav_open(struct wav *w, struct input *in, char *name)
+{
+    int tag = 0;
+    size_t pos, size;
+    unsigned char *p = in->data;
+
+    memset(w, 0, sizeof(*w));
+    if (in->size < 12 || memcmp(p, "RIFF", 4) != 0
+	|| memcmp(&p[8], "WAVE", 4) != 0) {
+	printf("%s: not a wav file\n", name);
+	exit(1);
+    }
+    for (pos = 12; pos + 8 <= in->size; pos += 8 + size + (size & 1)) {
+	size = get4(&p[pos + 4]);
+	if (size > in->size - pos - 8) {
+	    size = in->size - pos - 8;
+	}
+	if (memcmp(&p[pos], "fmt ", 4) == 0 && size >= 16) {
+	    tag = get2(&p[pos + 8]);
+	    w->nchannel = get2(&p[pos + 10]);
+	    w->sampling_rate = get4(&p[pos + 12]);
+	    w->quantization_bit = get2(&p[pos + 22]);
+	    if (tag == 0xfffe && size >= 26) {
+		tag = get2(&p[pos + 32]);
+	    }
+	}
+	if (memcmp(&p[pos], "data", 4) == 0) {
+	    w->data = &p[pos + 8];
+	    w->nsample = w->nchannel > 0 && w->quantization_bit > 0
+		? size / (w->nchannel * w->quantization_bit / 8) : 0;
+	    break;
+	}
+    }
+    if (w->data == NULL || w->nchannel < 1 || w->sampling_rate < 1
+	|| !((tag == 1 && (w->quantization_bit == 8
+			   || w->quantization_bit == 16
+			   || w->quantization_bit == 24))
+	     || (tag == 3 && w->quantization_bit == 32))) {
+	printf("%s: unsupported wav format\n", name);
+	exit(1);
+    }
+}
+
+
+/*
+ * The first channel of n samples, centred on zero.  Each width has its
+ * own loop, simple enough for the compiler to vectorize.
+ */
+static void wav_samples(struct wav *w, size_t first, int n, float *v)
+{
+    int i;
+    int stride = w->nchannel * w->quantization_bit / 8;
+    unsigned char *p = w->data + first * stride;
+    int16_t s16;
+
+    switch (w->quantization_bit) {
+      case 8:
+	for (i = 0; i < n; i++)
+	    v[i] = p[i * stride] - 128;
+	break;
+      case 16:
+	for (i = 0; i < n; i++) {
+	    memcpy(&s16, &p[i * stride], 2);
+	    v[i] = s16;
+	}
+	break;
+      case 24:
+	for (i = 0; i < n; i++)
+	    v[i] = (int32_t)((uint32_t)p[i * stride] << 8
+			     | (uint32_t)p[i * stride + 1] << 16
+			     | (uint32_t)p[i * stride + 2] << 24) >> 8;
+	break;
+      case 32:
+	for (i = 0; i < n; i++)
+	    memcpy(&v[i], &p[i * stride], 4);
+	break;
+    }
+}
+
+
+/*
+ * A zero crossing at position x ends a half cycle.  Consecutive half
+ * cycles of one carrier are collected into a run; silence ends the run
+ * and whatever byte was being framed.
+ */
+static void crossing(struct decoder *d, double x)
+{
+    int carrier;
+    double length = x - d->last;
+
+    d->last = x;
+    if (length > d->gap) {
+	run(d);
+	if (d->bit >= 0)
+	    d->nframe++;
+	d->bit = -1;
+	d->carrier = -1;
+	return;
+    }
+    carrier = length < d->high;
+    if (carrier != d->carrier) {
+	run(d);
+	d->carrier = carrier;
+    }
+    d->run++;
+}
+
+
+/* a finished run of one carrier is a whole number of bits */
+static void run(struct decoder *d)
+{
+    long n;
+
+    if (d->carrier >= 0) {
+	for (n = (d->run + d->halfcycles[d->carrier] / 2)
+		 / d->halfcycles[d->carrier]; n > 0; n--) {
+	    bit(d, d->carrier);
+	}
+    }
+    d->run = 0;
+}
+
+
+/* start bit 0, 8 data bits from bit 0 up, stop bits 1 */
+static void bit(struct decoder *d, int b)
+{
+    if (d->bit < 0) {
+	if (b == 0) {
+	    d->bit = 0;
+	    d->byte = 0;
+	}
+	return;
+    }
+    if (d->bit < 8) {
+	d->byte |= b << d->bit;
+    }else if (b == 0) {
+	d->nframe++;
+	d->bit = -1;
+	return;
+    }
+    if (++d->bit == 8 + d->stop_bit) {
+	byte(d, d->byte);
+	d->bit = -1;
+    }
+}
+
+
+/* a decoded byte, compared with the next one of the source */
+static void byte(struct decoder *d, int data)
+{
+    if (d->pos < d->length) {
+	while (d->off == d->iov[d->k].iov_len) {
+	    d->k++;
+	    d->off = 0;
+	}
+	if (((unsigned char *)d->iov[d->k].iov_base)[d->off++] != data
+	    && d->mismatch < 0) {
+	    d->mismatch = d->pos;
+	}
+    }else if (d->mismatch < 0) {
+	d->mismatch = d->pos;
+    }
+    d->pos++;
+    if (d->intelhex)
+	mon(d, data);
+}
+
+
+/*
+ * Checks the framing of encodeihex() as it goes by: an address header
+ * (':', address, checksum), blocks (':', length, data, checksum) and an
+ * end mark (':', 0, 0).  Header and block checksums make the sum of
+ * their bytes after the ':' zero.
+ */
+static void mon(struct decoder *d, int data)
+{
+    enum { HEADER, ADDRESS, MARK, LENGTH, DATA, END };
+
+    switch (d->mon) {
+      case HEADER:
+	if (data != 0x3a) {
+	    d->nsum++;
+	    break;
+	}
+	d->mon = ADDRESS;
+	d->left = 3;
+	d->sum = 0;
+	break;
+      case ADDRESS:
+	d->sum += data;
+	if (--d->left == 0) {
+	    if (d->sum != 0)
+		d->nsum++;
+	    d->mon = MARK;
+	}
+	break;
+      case MARK:
+	if (data != 0x3a)
+	    d->nsum++;
+	d->mon = LENGTH;
+	break;
+      case LENGTH:
+	d->sum = data;
+	d->left = data + 1;
+	d->mon = data == 0 ? END : DATA;
+	break;
+      case DATA:
+	d->sum += data;
+	if (--d->left == 0) {
+	    if (d->sum != 0)
+		d->nsum++;
+	    d->nblock++;
+	    d->mon = MARK;
+	}
+	break;
+      case END:
+	if (data != 0)
+	    d->nsum++;
+	d->mon = HEADER;
+	break;
+    }
+}
+
+
+static int get2(unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+
+static long get4(unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned long)p[3] << 24;
+}
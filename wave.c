@@ -0,0 +1,356 @@
+/*
+  wave.c : cache of rendered FSK bit cells
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "ihex2monl.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.141592653589793
+#endif
+
+#define WAVE_FRAGILE 0.125	/* margins checked on every use of a cell */
+
+static void wave_cache(struct tape *);
+static char *wave_sine(struct tape *, int);
+static double wave_value(struct tape *, double, double);
+static double wave_margin(struct tape *, double);
+
+
+/*
+ * Select the cache for the job's parameters.  Caches belong to a worker,
+ * so jobs it runs share rendered waveforms whenever their parameters
+ * match, and no locking is needed.
+ */
+static void wave_cache(struct tape *t)
+{
+    int i, j, k, f;
+    struct wave_cache *cache = t->cache;
+
+    if (cache != NULL && cache->sampling_rate == t->sampling_rate
+	&& cache->baud_rate == t->baud_rate
+	&& cache->carrier_low == t->carrier_low
+	&& cache->quantization_bit == t->quantization_bit
+	&& cache->nchannel == t->nchannel) {
+	return;
+    }
+    for (cache = *t->caches; cache != NULL; cache = cache->next) {
+	if (cache->sampling_rate == t->sampling_rate
+	    && cache->baud_rate == t->baud_rate
+	    && cache->carrier_low == t->carrier_low
+	    && cache->quantization_bit == t->quantization_bit
+	    && cache->nchannel == t->nchannel) {
+	    t->cache = cache;
+	    return;
+	}
+    }
+
+    cache = alloc(t, sizeof(struct wave_cache));
+    cache->sampling_rate = t->sampling_rate;
+    cache->baud_rate = t->baud_rate;
+    cache->carrier_low = t->carrier_low;
+    cache->quantization_bit = t->quantization_bit;
+    cache->nchannel = t->nchannel;
+    for (i = t->sampling_rate, j = t->carrier_low; j != 0; k = i % j, i = j, j = k)
+	;
+    cache->step = i;
+    cache->ncell = t->sampling_rate / cache->step + 1;
+    for (f = 0; f < 2; f++) {
+	cache->cell[f] = alloc(t, cache->ncell * sizeof(struct wave_cell *));
+	memset(cache->cell[f], 0, cache->ncell * sizeof(struct wave_cell *));
+    }
+    cache->sine[0] = NULL;
+    cache->sine[1] = NULL;
+    cache->next = *t->caches;
+    *t->caches = cache;
+    t->cache = cache;
+}
+
+
+/*
+ * Bit cells start on a carrier period boundary, so the offset of the
+ * first sample from the cell start is close to a multiple of
+ * gcd(sampling_rate, carrier_low) / (sampling_rate * carrier_low).
+ * Each offset and frequency is rendered once and kept for the run.
+ */
+struct wave_cell *wave_cell(struct tape *t, double freq, double offset)
+{
+    int i;
+    long long phase;
+    struct wave_cell *cell;
+    struct wave_cell **table;
+
+    wave_cache(t);
+
+    if (freq == t->carrier_low) {
+	table = t->cache->cell[0];
+    }else if (freq == t->carrier_low * 2) {
+	table = t->cache->cell[1];
+    }else{
+	return NULL;
+    }
+
+    phase = llround(offset * t->sampling_rate * t->carrier_low / t->cache->step);
+    if (phase < 0 || phase >= t->cache->ncell) {
+	return NULL;
+    }
+    if (table[phase] != NULL) {
+	return table[phase];
+    }
+
+    cell = alloc(t, sizeof(struct wave_cell));
+    cell->nsample = t->sampling_rate / t->baud_rate + 2;
+    cell->offset = alloc(t, cell->nsample * sizeof(double));
+    cell->margin = alloc(t, cell->nsample * sizeof(double));
+    cell->data = alloc(t, cell->nsample * t->nchannel * t->quantization_bit / 8);
+    cell->fragile = alloc(t, (cell->nsample + 1) * sizeof(int));
+
+    /* values go through the margin array on their way to the samples */
+    for (i = 0; i < cell->nsample; i++) {
+	cell->offset[i] = (phase * t->cache->step + (double)i * t->carrier_low)
+	    / ((double)t->sampling_rate * t->carrier_low);
+	cell->margin[i] = wave_value(t, freq, cell->offset[i]);
+    }
+    wave_format(t, cell->margin, cell->nsample, cell->data);
+    for (i = 0; i < cell->nsample; i++) {
+	cell->margin[i] = wave_margin(t, cell->margin[i]);
+    }
+    wave_bound(t, cell);
+
+    table[phase] = cell;
+    return cell;
+}
+
+
+/* render one sample of a cell at the given offset from the bit start */
+void wave_sample(struct tape *t, struct wave_cell *cell, int i, double freq, double offset)
+{
+    double v = wave_value(t, freq, offset);
+
+    cell->offset[i] = offset;
+    wave_format(t, &v, 1, &cell->data[i * t->nchannel * t->quantization_bit / 8]);
+    cell->margin[i] = wave_margin(t, v);
+}
+
+
+/*
+ * Summary of a cell for fsk_bit(): how far its offsets stray from an
+ * evenly spaced run of samples, the samples whose margin is small enough
+ * to be checked on every use, and the smallest margin of the others.
+ * Called again whenever samples of the cell are rendered anew.
+ */
+void wave_bound(struct tape *t, struct wave_cell *cell)
+{
+    int i, n = 0;
+    double r, step = 1. / t->sampling_rate;
+
+    cell->low = cell->offset[0];
+    cell->high = cell->offset[0];
+    cell->least = HUGE_VAL;
+    for (i = 0; i < cell->nsample; i++) {
+	r = cell->offset[i] - i * step;
+	if (r < cell->low)
+	    cell->low = r;
+	if (r > cell->high)
+	    cell->high = r;
+	if (cell->margin[i] < WAVE_FRAGILE)
+	    cell->fragile[n++] = i;
+	else if (cell->margin[i] < cell->least)
+	    cell->least = cell->margin[i];
+    }
+    cell->fragile[n] = cell->nsample;
+}
+
+
+/* sample value before truncation */
+static double wave_value(struct tape *t, double freq, double offset)
+{
+    switch (t->quantization_bit) {
+      case 8:
+	return 128 - 127 * sin(2 * M_PI * freq * offset);
+      case 16:
+	return -32767 * sin(2 * M_PI * freq * offset);
+      case 24:
+	return -8388607 * sin(2 * M_PI * freq * offset);
+      default:
+	return -sin(2 * M_PI * freq * offset);
+    }
+}
+
+
+/*
+ * Distance of a value from the nearest one truncating to another sample.
+ * Float samples round to within about 1e-7 of their value, closer than
+ * the drift of time, so the cache could never keep them; jobs wider than
+ * 16 bits are rendered by wave_dds_bit() instead and never get here.
+ */
+static double wave_margin(struct tape *t, double v)
+{
+    double low, high;
+
+    if (t->quantization_bit == 32) {
+	return 0;
+    }else if (t->quantization_bit >= 16 && v < 0) {
+	high = ceil(v);
+	low = high - 1;
+    }else if (t->quantization_bit >= 16 && v < 1) {
+	low = -1;
+	high = 1;
+    }else{
+	low = floor(v);
+	high = low + 1;
+    }
+    return v - low < high - v ? v - low : high - v;
+}
+
+
+/*
+ * Truncate n values to 8-bit unsigned or 16/24-bit little endian samples,
+ * as the per-sample code did, or round them to 32-bit floats, and write
+ * them to every channel.  With SSE2 eight or four values are converted
+ * at a time and stereo is made by interleaving the packed samples with
+ * themselves.
+ */
+void wave_format(struct tape *t, const double *v, int n, char *data)
+{
+    int i = 0, j, s;
+    int nchannel = t->nchannel;
+    int bytes = t->quantization_bit / 8;
+    float f;
+#ifdef __SSE2__
+    __m128i a, b;
+    __m128 x;
+
+    if (t->quantization_bit == 32) {
+	for (; i + 4 <= n; i += 4) {
+	    x = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(&v[i])),
+			      _mm_cvtpd_ps(_mm_loadu_pd(&v[i + 2])));
+	    if (nchannel == 1) {
+		_mm_storeu_ps((float *)&data[i * 4], x);
+	    }else{
+		_mm_storeu_ps((float *)&data[i * 8], _mm_unpacklo_ps(x, x));
+		_mm_storeu_ps((float *)&data[i * 8 + 16], _mm_unpackhi_ps(x, x));
+	    }
+	}
+    }else if (t->quantization_bit == 24) {
+	/* three byte samples do not pack; the scalar loop does them */
+    }else if (t->quantization_bit == 8) {
+	for (; i + 8 <= n; i += 8) {
+	    a = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_loadu_pd(&v[i])),
+				   _mm_cvttpd_epi32(_mm_loadu_pd(&v[i + 2])));
+	    b = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_loadu_pd(&v[i + 4])),
+				   _mm_cvttpd_epi32(_mm_loadu_pd(&v[i + 6])));
+	    a = _mm_packs_epi32(a, b);
+	    a = _mm_packus_epi16(a, a);
+	    if (nchannel == 1) {
+		_mm_storel_epi64((__m128i *)&data[i], a);
+	    }else{
+		_mm_storeu_si128((__m128i *)&data[i * 2], _mm_unpacklo_epi8(a, a));
+	    }
+	}
+    }else{
+	for (; i + 4 <= n; i += 4) {
+	    a = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_loadu_pd(&v[i])),
+				   _mm_cvttpd_epi32(_mm_loadu_pd(&v[i + 2])));
+	    a = _mm_packs_epi32(a, a);
+	    if (nchannel == 1) {
+		_mm_storel_epi64((__m128i *)&data[i * 2], a);
+	    }else{
+		_mm_storeu_si128((__m128i *)&data[i * 4], _mm_unpacklo_epi16(a, a));
+	    }
+	}
+    }
+#endif
+
+    for (; i < n; i++) {
+	s = v[i];
+	f = v[i];
+	for (j = 0; j < nchannel; j++) {
+	    switch (t->quantization_bit) {
+	      case 32:
+		memcpy(&data[(i * nchannel + j) * 4], &f, 4);
+		break;
+	      default:
+		data[(i * nchannel + j) * bytes] = s & 0xff;
+		if (bytes > 1)
+		    data[(i * nchannel + j) * bytes + 1] = (s >> 8) & 0xff;
+		if (bytes > 2)
+		    data[(i * nchannel + j) * bytes + 2] = (s >> 16) & 0xff;
+	    }
+	}
+    }
+}
+
+
+/*
+ * Integer oscillator for -D and for samples wider than 16 bits.  Time is
+ * the sample number n, and sample n lies n * carrier_low ticks of
+ * 1 / (sampling_rate * carrier_low) s into the tape, so bit starts
+ * (carrier period boundaries) and bit lengths are exact and never drift.
+ * The phase of sample n from its bit start is n * freq / sampling_rate
+ * cycles, whole cycles dropped, so it only depends on n modulo the
+ * period of freq in samples; each bit is one copy out of a table of the
+ * carrier rendered along that period.
+ */
+int wave_dds_bit(struct tape *t, double freq, char *data)
+{
+    int count, h;
+    int sampling_rate = t->sampling_rate;
+    int carrier_low = t->carrier_low;
+    int bytes = t->nchannel * t->quantization_bit / 8;
+    long long start, end;
+    char *sine;
+
+    wave_cache(t);
+    start = t->tick * carrier_low / sampling_rate * sampling_rate;
+    end = start + (long long)sampling_rate * (carrier_low / t->baud_rate);
+    count = (end + carrier_low - 1) / carrier_low - t->tick;
+
+    if (data != NULL) {
+	h = freq == carrier_low ? 0 : 1;
+	sine = wave_sine(t, h);
+	memcpy(data, &sine[t->tick % t->cache->nsine[h] * bytes], count * bytes);
+    }
+
+    t->tick += count;
+    t->time = (double)t->tick / sampling_rate;
+    return count * bytes;
+}
+
+
+/*
+ * Carrier low (h = 0) or high (h = 1) rendered at sample k for one period
+ * and then far enough into the next for a whole bit to start anywhere.
+ */
+static char *wave_sine(struct tape *t, int h)
+{
+    int i, j, k, n, period;
+    int freq = t->carrier_low * (h + 1);
+    double *v;
+    char *sine = t->cache->sine[h];
+
+    if (sine != NULL) {
+	return sine;
+    }
+    for (i = t->sampling_rate, j = freq; j != 0; k = i % j, i = j, j = k)
+	;
+    period = t->sampling_rate / i;
+    n = period + t->sampling_rate / t->baud_rate + 2;
+    v = alloc(t, n * sizeof(double));
+    for (k = 0; k < n; k++) {
+	v[k] = wave_value(t, 1, (double)((long long)k * freq % t->sampling_rate)
+			  / t->sampling_rate);
+    }
+    sine = alloc(t, n * t->nchannel * t->quantization_bit / 8);
+    wave_format(t, v, n, sine);
+    free(v);
+    t->cache->sine[h] = sine;
+    t->cache->nsine[h] = period;
+    return sine;
+}